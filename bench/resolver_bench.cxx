@@ -0,0 +1,144 @@
+/*
+ * Closed-loop resolve benchmark against the in-process stub server.
+ *
+ *   cares_service_bench [queries-per-run] [stub-latency-ms]
+ *
+ * For every resolve mode and concurrency level it reports throughput,
+ * latency percentiles and heap allocations per resolve (operator new plus
+ * c-ares' own allocations).
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <cares_service/cares.hxx>
+
+#include "stub_dns_server.hxx"
+
+namespace {
+
+/* only the resolving thread counts, the stub server runs on its own */
+thread_local bool t_counting = false;
+size_t g_allocations = 0;
+
+void CountAllocation() {
+    if (t_counting) {
+        ++g_allocations;
+    }
+}
+
+void *CountingMalloc(size_t size) {
+    CountAllocation();
+    return std::malloc(size);
+}
+
+void *CountingRealloc(void *ptr, size_t size) {
+    if (!ptr) {
+        CountAllocation();
+    }
+    return std::realloc(ptr, size);
+}
+
+struct Report {
+    double qps;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double allocations;
+    size_t errors;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+Report Run(const std::string &servers, const std::string &mode, size_t concurrency, size_t total) {
+    boost::asio::io_context context;
+    cares::tcp::resolver resolver{context};
+    boost::system::error_code ec;
+    resolver.set_servers(servers, ec);
+    resolver.resolve_mode(mode, ec);
+
+    std::vector<double> latencies;
+    latencies.reserve(total);
+    size_t issued = 0;
+    size_t errors = 0;
+
+    std::function<void()> issue = [&]() {
+        if (issued == total) {
+            return;
+        }
+        auto name = "bench" + std::to_string(issued++) + "." + mode + ".test";
+        auto start = clock_type::now();
+        resolver.async_resolve(
+            name, 443,
+            [&, start](boost::system::error_code ec, cares::tcp::resolver::results_type) {
+                std::chrono::duration<double, std::micro> latency = clock_type::now() - start;
+                latencies.push_back(latency.count());
+                errors += !!ec;
+                issue();
+            }
+        );
+    };
+
+    auto allocations = g_allocations;
+    auto start = clock_type::now();
+    t_counting = true;
+    for (size_t i = 0; i < concurrency; ++i) {
+        issue();
+    }
+    context.run();
+    t_counting = false;
+    std::chrono::duration<double> elapsed = clock_type::now() - start;
+    allocations = g_allocations - allocations;
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+    };
+    return Report{
+        total / elapsed.count(),
+        percentile(0.50), percentile(0.99), percentile(0.999),
+        static_cast<double>(allocations) / total,
+        errors
+    };
+}
+
+} // namespace
+
+void *operator new(size_t size) {
+    CountAllocation();
+    if (auto ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+int main(int argc, char *argv[]) {
+    size_t total = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+    cares::test::StubDnsServer::Options options;
+    options.latency = std::chrono::milliseconds{argc > 2 ? std::atoi(argv[2]) : 0};
+
+    ::ares_library_init_mem(ARES_LIB_INIT_ALL, CountingMalloc, std::free, CountingRealloc);
+    cares::test::StubDnsServer server{options};
+
+    std::printf("%-14s %6s %10s %10s %10s %10s %10s %7s\n",
+                "mode", "conc", "qps", "p50(us)", "p99(us)", "p999(us)", "alloc/op", "errors");
+    for (auto &mode : cares::available_resolve_modes()) {
+        for (size_t concurrency : {1, 16, 128}) {
+            auto report = Run(server.Servers(), mode, concurrency, total);
+            std::printf("%-14s %6zu %10.0f %10.1f %10.1f %10.1f %10.1f %7zu\n",
+                        mode.c_str(), concurrency, report.qps,
+                        report.p50_us, report.p99_us, report.p999_us,
+                        report.allocations, report.errors);
+        }
+    }
+    ::ares_library_cleanup();
+    return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "detail/io_object.hxx"
 #include "detail/service.hxx"
+#include "detail/channel_pool.hxx"
 #include "detail/error.hxx"
 
 namespace cares {
@@ -10,15 +11,24 @@ namespace cares {
 template<class Protocol>
 using resolver = detail::basic_cares_resolver<detail::base_cares_service<Protocol>>;
 
+template<class Protocol>
+using pool_resolver = detail::basic_cares_resolver<detail::base_cares_service<Protocol, detail::ChannelPool>>;
+
 namespace tcp {
 using resolver = ::cares::resolver<boost::asio::ip::tcp>;
+using pool_resolver = ::cares::pool_resolver<boost::asio::ip::tcp>;
 } // namespace tcp
 
 namespace udp {
 using resolver = ::cares::resolver<boost::asio::ip::udp>;
+using pool_resolver = ::cares::pool_resolver<boost::asio::ip::udp>;
 } // namespace udp
 
 using detail::available_resolve_modes;
+using detail::batch_statistics;
+using detail::cache_options;
+using detail::hedge_options;
+using detail::resolver_stats;
 
 } // namespace cares
 
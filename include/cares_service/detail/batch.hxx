@@ -0,0 +1,129 @@
+#ifndef __CARES_SERVICES_BATCH_HXX__
+#define __CARES_SERVICES_BATCH_HXX__
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+namespace cares {
+namespace detail {
+
+struct batch_statistics {
+    using duration = std::chrono::steady_clock::duration;
+
+    size_t total = 0;
+    size_t succeeded = 0;
+    size_t failed = 0;
+    /* wall time from the first query issued to the last result delivered */
+    duration elapsed{0};
+    /* latency of the slowest single query */
+    duration slowest{0};
+};
+
+/*
+ * Resolves a list of (name, port) with at most `window` queries outstanding,
+ * launching the next query as soon as one result lands. All bookkeeping and
+ * both user handlers run on the batch's own strand.
+ */
+template<class Service, class ResultHandler, class CompletionHandler>
+class BatchResolve : public std::enable_shared_from_this<BatchResolve<Service, ResultHandler, CompletionHandler>> {
+public:
+    using clock_type = std::chrono::steady_clock;
+    using implementation_type = typename Service::implementation_type;
+    using results_type = typename Service::results_type;
+    using query_list = std::vector<std::pair<std::string, uint16_t>>;
+
+    BatchResolve(Service &service, implementation_type impl, query_list queries, size_t window,
+                 ResultHandler result_handler, CompletionHandler completion_handler)
+        : service_(service), impl_(std::move(impl)), strand_(service.get_io_context()),
+          queries_(std::move(queries)), started_(queries_.size()),
+          window_(std::max<size_t>(window, 1)), next_(0),
+          result_handler_(std::move(result_handler)),
+          completion_handler_(std::move(completion_handler)) {
+        stats_.total = queries_.size();
+    }
+
+    template<class Range>
+    static query_list MakeQueries(const Range &range) {
+        query_list queries;
+        for (auto &query : range) {
+            queries.emplace_back(std::get<0>(query), std::get<1>(query));
+        }
+        return queries;
+    }
+
+    void Start() {
+        auto self{this->shared_from_this()};
+        boost::asio::post(
+            strand_,
+            [this, self]() {
+                start_ = clock_type::now();
+                if (queries_.empty()) {
+                    completion_handler_(stats_);
+                    return;
+                }
+                while (next_ < queries_.size() && next_ < window_) {
+                    Launch();
+                }
+            }
+        );
+    }
+
+private:
+    void Launch() {
+        auto self{this->shared_from_this()};
+        auto index = next_++;
+        started_[index] = clock_type::now();
+        service_.async_resolve(
+            impl_, queries_[index].first, queries_[index].second,
+            [this, self, index](boost::system::error_code ec, results_type result) {
+                boost::asio::post(
+                    strand_,
+                    [this, self, index, ec, result = std::move(result)]() mutable {
+                        OnResult(index, ec, std::move(result));
+                    }
+                );
+            }
+        );
+    }
+
+    void OnResult(size_t index, boost::system::error_code ec, results_type result) {
+        auto now = clock_type::now();
+        stats_.slowest = std::max<batch_statistics::duration>(stats_.slowest, now - started_[index]);
+        if (ec) {
+            ++stats_.failed;
+        } else {
+            ++stats_.succeeded;
+        }
+        result_handler_(ec, queries_[index].first, std::move(result));
+
+        if (next_ < queries_.size()) {
+            Launch();
+        } else if (stats_.succeeded + stats_.failed == stats_.total) {
+            stats_.elapsed = now - start_;
+            completion_handler_(stats_);
+        }
+    }
+
+    Service &service_;
+    implementation_type impl_;
+    boost::asio::io_context::strand strand_;
+    query_list queries_;
+    std::vector<clock_type::time_point> started_;
+    clock_type::time_point start_;
+    size_t window_;
+    size_t next_;
+    batch_statistics stats_;
+    ResultHandler result_handler_;
+    CompletionHandler completion_handler_;
+};
+
+} // namespace detail
+} // namespace cares
+
+#endif // __CARES_SERVICES_BATCH_HXX__
@@ -0,0 +1,205 @@
+#ifndef __CARES_SERVICES_CACHE_HXX__
+#define __CARES_SERVICES_CACHE_HXX__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "error.hxx"
+#include "resolve_mode.hxx"
+
+namespace cares {
+namespace detail {
+
+struct cache_options {
+    /* maximum number of cached names, 0 disables the cache */
+    size_t capacity = 0;
+    /* upper bound applied to the record ttl of positive answers */
+    std::chrono::seconds max_ttl{3600};
+    /* how long NXDOMAIN/NODATA answers are remembered */
+    std::chrono::seconds negative_ttl{30};
+};
+
+class ResultCache {
+public:
+    using clock_type = std::chrono::steady_clock;
+    using address = boost::asio::ip::address;
+    using address_list = std::vector<address>;
+
+    ResultCache()
+        : enabled_(false) {
+    }
+
+    ResultCache(const ResultCache &) = delete;
+
+    void SetOptions(const cache_options &options) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        options_ = options;
+        Shrink(options_.capacity);
+        enabled_.store(options_.capacity != 0, std::memory_order_relaxed);
+    }
+
+    /* checked on every resolve, never takes the lock */
+    bool IsEnabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    /* returns true on hit, either appending the addresses or setting a negative error */
+    template<class Results>
+    bool Lookup(const std::string &name, resolve_mode mode, Results &result, boost::system::error_code &ec) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto itr = index_.find(Key{name, mode});
+        if (itr == index_.end()) {
+            return false;
+        }
+        auto entry = itr->second;
+        if (entry->expiry <= clock_type::now()) {
+            index_.erase(itr);
+            entries_.erase(entry);
+            return false;
+        }
+        entries_.splice(entries_.begin(), entries_, entry);
+        for (auto &address : entry->addresses) {
+            result.Append(address);
+        }
+        ec = entry->error;
+        return true;
+    }
+
+    template<class Results>
+    void Store(const std::string &name, resolve_mode mode, const boost::system::error_code &ec, const Results &result) {
+        address_list addresses;
+        std::chrono::seconds ttl;
+        boost::system::error_code negative;
+        int record_ttl;
+
+        if (!ec && !result.IsEmpty()) {
+            if (!result.MinTtl(record_ttl) || record_ttl <= 0) {
+                return;
+            }
+            for (auto &ep : result) {
+                addresses.push_back(ep.address());
+            }
+            ttl = std::chrono::seconds{record_ttl};
+        } else if (error::is_negative_answer(ec)) {
+            negative = ec;
+            ttl = std::chrono::seconds::max();
+        } else {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (options_.capacity == 0) {
+            return;
+        }
+        /* a family that failed must be asked again soon, not after the record ttl */
+        ttl = std::min(ttl, negative || result.IsPartial() ? options_.negative_ttl : options_.max_ttl);
+        if (ttl.count() <= 0) {
+            return;
+        }
+
+        Key key{name, mode};
+        auto itr = index_.find(key);
+        if (itr != index_.end()) {
+            entries_.erase(itr->second);
+            index_.erase(itr);
+        }
+        Shrink(options_.capacity - 1);
+        entries_.push_front(Entry{key, std::move(addresses), negative, clock_type::now() + ttl});
+        index_.emplace(std::move(key), entries_.begin());
+    }
+
+    /*
+     * Appends late records to a live positive entry, the shorter ttl wins.
+     * A late failure leaves the entry partial, so it expires like one.
+     */
+    template<class Results>
+    void Extend(const std::string &name, resolve_mode mode, const boost::system::error_code &ec, const Results &result) {
+        int record_ttl;
+        bool failed = ec && !error::is_negative_answer(ec);
+        if (!failed && (ec || result.IsEmpty() || !result.MinTtl(record_ttl) || record_ttl <= 0)) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto itr = index_.find(Key{name, mode});
+        if (itr == index_.end() || itr->second->error) {
+            return;
+        }
+        auto &entry = *itr->second;
+        if (failed) {
+            entry.expiry = std::min(entry.expiry, clock_type::now() + options_.negative_ttl);
+            return;
+        }
+        auto ttl = std::min(std::chrono::seconds{record_ttl}, options_.max_ttl);
+        entry.expiry = std::min(entry.expiry, clock_type::now() + ttl);
+        /* keep the order of a fresh answer, IPv6 before IPv4 */
+        auto v4 = std::find_if(
+            entry.addresses.begin(), entry.addresses.end(),
+            [](const boost::asio::ip::address &address) { return address.is_v4(); }
+        );
+        auto v6_count = v4 - entry.addresses.begin();
+        for (auto &ep : result) {
+            if (ep.address().is_v6()) {
+                entry.addresses.insert(entry.addresses.begin() + v6_count++, ep.address());
+            } else {
+                entry.addresses.push_back(ep.address());
+            }
+        }
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock{mutex_};
+        index_.clear();
+        entries_.clear();
+    }
+
+private:
+    struct Key {
+        std::string name;
+        resolve_mode mode;
+
+        bool operator==(const Key &other) const {
+            return mode == other.mode && name == other.name;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            return std::hash<std::string>{}(key.name) * 31 + key.mode;
+        }
+    };
+
+    struct Entry {
+        Key key;
+        address_list addresses;
+        boost::system::error_code error;
+        clock_type::time_point expiry;
+    };
+
+    using entry_list = std::list<Entry>;
+
+    void Shrink(size_t size) {
+        while (entries_.size() > size) {
+            index_.erase(entries_.back().key);
+            entries_.pop_back();
+        }
+    }
+
+    std::atomic<bool> enabled_;
+    std::mutex mutex_;
+    cache_options options_;
+    entry_list entries_;
+    std::unordered_map<Key, entry_list::iterator, KeyHash> index_;
+};
+
+} // namespace detail
+} // namespace cares
+
+#endif // __CARES_SERVICES_CACHE_HXX__
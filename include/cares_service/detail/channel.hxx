@@ -11,14 +11,25 @@
     #define SET_SOCKERRNO(x) (errno = (x))
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <memory>
-#include <map>
+#include <string>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/intrusive/set.hpp>
 #include <boost/variant.hpp>
 #include <ares.h>
 
+#include "cache.hxx"
 #include "error.hxx"
+#include "hedge.hxx"
+#include "mpsc_queue.hxx"
 #include "resolve_mode.hxx"
+#include "stats.hxx"
 
 namespace cares {
 namespace detail {
@@ -34,6 +45,13 @@ inline ares_ssize_t SendSocket(ares_socket_t fd, const struct iovec *data, int l
 
 inline void SocketStateCb(void *arg, ares_socket_t fd, int readable, int writeable);
 
+/* default "more endpoints" handler, records arriving after delivery are dropped */
+struct NoMoreEndpoints {
+    template<class Results>
+    void operator()(boost::system::error_code, Results) const {
+    }
+};
+
 class Channel : public std::enable_shared_from_this<Channel> {
 public:
     using resolve_mode = ::cares::detail::resolve_mode;
@@ -43,12 +61,14 @@ private:
         using tcp_type = boost::asio::ip::tcp::socket;
         using udp_type = boost::asio::ip::udp::socket;
 
-        Socket(tcp_type tcp)
-            : socket_(std::move(tcp)), is_tcp_(true) {
+        using strand_type = boost::asio::io_context::strand;
+
+        Socket(tcp_type tcp, strand_type &strand)
+            : socket_(std::move(tcp)), is_tcp_(true), strand_(strand) {
         }
 
-        Socket(udp_type udp)
-            : socket_(std::move(udp)), is_tcp_(false) {
+        Socket(udp_type udp, strand_type &strand)
+            : socket_(std::move(udp)), is_tcp_(false), strand_(strand) {
         }
 
         Socket(Socket &&) = default;
@@ -99,9 +119,9 @@ private:
                     }
                 };
             if (IsTcp()) {
-                GetTcp().async_wait(tcp_type::wait_read, std::move(handler));
+                GetTcp().async_wait(tcp_type::wait_read, boost::asio::bind_executor(strand_, std::move(handler)));
             } else {
-                GetUdp().async_wait(udp_type::wait_read, std::move(handler));
+                GetUdp().async_wait(udp_type::wait_read, boost::asio::bind_executor(strand_, std::move(handler)));
             }
         }
 
@@ -116,36 +136,30 @@ private:
                     }
                 };
             if (IsTcp()) {
-                GetTcp().async_wait(tcp_type::wait_write, std::move(handler));
+                GetTcp().async_wait(tcp_type::wait_write, boost::asio::bind_executor(strand_, std::move(handler)));
             } else {
-                GetUdp().async_wait(udp_type::wait_write, std::move(handler));
+                GetUdp().async_wait(udp_type::wait_write, boost::asio::bind_executor(strand_, std::move(handler)));
             }
         }
 
         boost::variant<udp_type, tcp_type> socket_;
         bool is_tcp_;
+        /* re-arming a wait must not race with SocketStateCb */
+        strand_type &strand_;
     };
 public:
-    using AsyncCallback = std::function<void(boost::system::error_code, struct hostent *)>;
     using native_handle_type = ares_channel;
 
     Channel(const Channel &) = delete;
     explicit Channel(boost::asio::io_context &ios, boost::posix_time::time_duration timeout = boost::posix_time::millisec{3000})
-        : context_(ios), strand_(context_),
-          timer_(context_), timer_period_(timeout / 2),
-          functions_(GetSocketFunctions()), request_count_(0),
-          resolve_mode_(both) {
-
-        struct ares_options option;
-        memset(&option, 0, sizeof option);
-        option.sock_state_cb = SocketStateCb;
-        option.sock_state_cb_data = this;
-        option.timeout = timeout.total_milliseconds();
-        option.tries = 1;
-        option.lookups = GetAresLookups();
-        int mask = ARES_OPT_NOROTATE | ARES_OPT_TIMEOUTMS | ARES_OPT_SOCK_STATE_CB | ARES_OPT_TRIES | ARES_OPT_LOOKUPS;
-
-        int ret = ::ares_init_options(&channel_, &option, mask);
+        : context_(ios), strand_(context_), timeout_(timeout),
+          timer_(context_), timer_armed_(false),
+          functions_(GetSocketFunctions()), free_completes_(nullptr),
+          request_count_(0), resolve_mode_(both),
+          resolution_delay_(std::chrono::milliseconds{50}), drain_scheduled_(false),
+          cache_(std::make_shared<ResultCache>()) {
+
+        int ret = InitHandle(channel_);
         if (ret != ARES_SUCCESS) {
             boost::system::error_code ec{ret, error::get_category()};
             boost::throw_exception(
@@ -154,59 +168,147 @@ public:
                 }
             );
         }
-
-        ::ares_set_socket_functions(channel_, functions_.get(), this);
     }
 
     ~Channel() {
-        Cancel();
+        ForEachHandle([](native_handle_type handle) {
+            ::ares_cancel(handle);
+        });
+        timer_.cancel();
         ::ares_destroy(channel_);
+        DestroyUpstreams(upstreams_);
+        DestroyUpstreams(retired_upstreams_);
+        for (auto handle : retired_) {
+            ::ares_destroy(handle);
+        }
+        while (free_completes_) {
+            std::unique_ptr<ChannelComplete> comp{free_completes_};
+            free_completes_ = comp->next_free;
+        }
     }
 
     template<class Results, class Handler>
-    void AsyncGetHostByName(const std::string &domain, std::shared_ptr<Results> result, std::shared_ptr<Handler> handler) {
-        auto self{shared_from_this()};
-        auto mode = GetResolveMode();
-        auto remain_requests = std::make_shared<uint32_t>(1);
+    void AsyncGetHostByName(const std::string &domain, Results result, Handler &&handler) {
+        AsyncGetHostByName(domain, std::move(result), std::forward<Handler>(handler), NoMoreEndpoints{});
+    }
 
-        if (mode != ipv6_only && mode != ipv4_only) {
-            ++*remain_requests;
-        }
+    /*
+     * All per-call state lives in one ResolveRequest. Like asio's
+     * handler_ptr, memory from the handler's associated allocator is given
+     * back before the handler runs. Only modes that are finished once the
+     * handler is due use it: unspecific may leave the other family
+     * pending, and happy_eyeballs keeps the request for more(ec, results).
+     */
+    template<class Results, class Handler, class MoreHandler>
+    void AsyncGetHostByName(const std::string &domain, Results result, Handler &&handler, MoreHandler &&more) {
+        using handler_type = typename std::decay<Handler>::type;
+        using more_type = typename std::decay<MoreHandler>::type;
+        using request_type = ResolveRequest<Results, handler_type, more_type>;
+        using allocator_type = typename std::allocator_traits<
+            boost::asio::associated_allocator_t<handler_type>
+        >::template rebind_alloc<request_type>;
 
-        if (mode != ipv6_only) {
-            AsyncGetHostByNameInternal(
-                domain, AF_INET,
-                std::bind(
-                    &Channel::ResultHandler<Results, Handler>, self,
-                    std::placeholders::_1, std::placeholders::_2,
-                    result, handler, remain_requests
-                )
+        auto mode = GetResolveMode();
+        std::shared_ptr<request_type> request;
+        if (mode == unspecific || mode == happy_eyeballs) {
+            request = std::make_shared<request_type>(
+                shared_from_this(), mode, std::move(result), std::move(handler), std::move(more)
+            );
+        } else {
+            allocator_type alloc{boost::asio::get_associated_allocator(handler)};
+            request = std::allocate_shared<request_type>(
+                alloc, shared_from_this(), mode, std::move(result), std::move(handler), std::move(more)
             );
         }
+        stats_.OnResolve(mode);
 
-        if (mode != ipv4_only) {
-            AsyncGetHostByNameInternal(
-                domain, AF_INET6,
-                std::bind(
-                    &Channel::ResultHandler<Results, Handler>, self,
-                    std::placeholders::_1, std::placeholders::_2,
-                    result, handler, remain_requests
-                )
+        if (domain.size() >= sizeof request->domain) {
+            boost::system::error_code ec{error::bad_name, error::get_category()};
+            stats_.OnError(error::bad_name);
+            stats_.OnResolved(mode, ChannelStats::clock_type::duration::zero());
+            boost::asio::post(
+                context_,
+                [request = std::move(request), ec]() mutable {
+                    Upcall(std::move(request), ec);
+                }
             );
+            return;
+        }
+        memcpy(request->domain, domain.c_str(), domain.size() + 1);
+
+        request->remain = 1;
+        if (mode != ipv6_only && mode != ipv4_only) {
+            ++request->remain;
         }
+
+        /* the last waiter takes our reference, so the upcall can release the request */
+        auto &v4 = request->waiters[0];
+        auto &v6 = request->waiters[1];
+        if (mode == ipv4_only) {
+            AsyncGetHostByNameInternal(std::move(request), v4, AF_INET);
+            return;
+        }
+        if (mode != ipv6_only) {
+            AsyncGetHostByNameInternal(request, v4, AF_INET);
+        }
+        AsyncGetHostByNameInternal(std::move(request), v6, AF_INET6);
     }
 
     void Cancel() {
-        ::ares_cancel(channel_);
-        TimerStop();
+        auto self{shared_from_this()};
+        boost::asio::post(
+            strand_,
+            [this, self]() {
+                ForEachHandle([](native_handle_type handle) {
+                    ::ares_cancel(handle);
+                });
+                TimerUpdate();
+            }
+        );
     }
 
+    /*
+     * The list is checked on the calling thread and applied on strand_,
+     * queries already sent finish on the previous servers.
+     */
     void SetServerPortsCsv(const std::string &servers, boost::system::error_code &ec) {
         ec.clear();
-        int ret = ::ares_set_servers_ports_csv(channel_, servers.c_str());
+        int ret = ValidateServers(servers);
         if (ret != ARES_SUCCESS) {
             ec.assign(ret, error::get_category());
+            return;
+        }
+        cache_->Clear();
+        auto self{shared_from_this()};
+        boost::asio::post(strand_, [this, self, servers]() { ApplyServers(servers); });
+    }
+
+    void SetHedgeOptions(const hedge_options &options, boost::system::error_code &ec) {
+        ec.clear();
+        if (options.max_attempts == 0 || options.delay.count() < 0) {
+            ec.assign(error::bad_flags, error::get_category());
+            return;
         }
+        auto self{shared_from_this()};
+        boost::asio::post(
+            strand_,
+            [this, self, options]() {
+                hedge_options_ = options;
+                BuildUpstreams();
+                TimerUpdate();
+            }
+        );
+    }
+
+    void SetShards(size_t shards, boost::system::error_code &ec) {
+        ec.clear();
+        if (shards != 1) {
+            ec.assign(error::not_implemented, error::get_category());
+        }
+    }
+
+    size_t GetShards() const {
+        return 1;
     }
 
     void SetResolveMode(resolve_mode mode, boost::system::error_code &ec) {
@@ -215,57 +317,352 @@ public:
             ec.assign(error::not_implemented, error::get_category());
             return;
         }
-        resolve_mode_ = mode;
+        resolve_mode_.store(mode, std::memory_order_relaxed);
     }
 
     resolve_mode GetResolveMode() const {
-        return resolve_mode_;
+        return resolve_mode_.load(std::memory_order_relaxed);
+    }
+
+    /* how long happy_eyeballs waits for AAAA once A has answered */
+    void SetResolutionDelay(std::chrono::milliseconds delay) {
+        resolution_delay_.store(delay, std::memory_order_relaxed);
+    }
+
+    std::chrono::milliseconds GetResolutionDelay() const {
+        return resolution_delay_.load(std::memory_order_relaxed);
     }
 
+    /* set_servers may replace the handle while queries are pending, use it on strand_ only */
     native_handle_type GetNativeHandle() {
         return channel_;
     }
 
+    void CollectStats(resolver_stats &stats) const {
+        stats_.Collect(stats);
+    }
+
+    /* answers only ever come from this channel's servers, null while disabled */
+    std::shared_ptr<ResultCache> GetCache(const std::string &) const {
+        return cache_->IsEnabled() ? cache_ : nullptr;
+    }
+
+    void SetCacheOptions(const cache_options &options) {
+        cache_->SetOptions(options);
+    }
+
+    void ClearCache() {
+        cache_->Clear();
+    }
+
 private:
-    struct ChannelComplete {
+    /* one family (A or AAAA) of a resolve, waiting for its query to finish */
+    struct QueryWaiter : public MpscNode {
+        virtual void Complete(boost::system::error_code ec, const struct ares_addrinfo *info) = 0;
+
+        const char *domain = nullptr;
+        int family = AF_UNSPEC;
+        QueryWaiter *next_waiter = nullptr;
+        /* keeps the enclosing request alive until Complete */
+        std::shared_ptr<void> owner;
+
+    protected:
+        ~QueryWaiter() = default;
+    };
+
+    template<class Results, class Handler, class MoreHandler>
+    struct ResolveRequest {
+        static constexpr bool has_more = !std::is_same<MoreHandler, NoMoreEndpoints>::value;
+
+        struct Waiter : public QueryWaiter {
+            void Complete(boost::system::error_code ec, const struct ares_addrinfo *info) override {
+                auto self = std::static_pointer_cast<ResolveRequest>(this->owner);
+                this->owner.reset();
+                self->channel->ResultHandler(ec, info, this->family, self);
+            }
+        };
+
+        ResolveRequest(std::shared_ptr<Channel> ch, resolve_mode m, Results r, Handler h, MoreHandler mh)
+            : channel(std::move(ch)), mode(m), remain(0),
+              started(ChannelStats::clock_type::now()),
+              result(std::move(r)), port(result.Port()), handler(std::move(h)), more(std::move(mh)),
+              handoff(false) {
+        }
+
+        void InvokeMore() {
+            more(late_error, std::move(*late));
+        }
+
         std::shared_ptr<Channel> channel;
-        AsyncCallback callback;
+        resolve_mode mode;
+        uint32_t remain;
+        ChannelStats::clock_type::time_point started;
+        bool delivered = false;
+        Results result;
+        uint16_t port;
+        Handler handler;
+        Waiter waiters[2];
+        char domain[256];
+
+        /* happy_eyeballs only */
+        MoreHandler more;
+        std::unique_ptr<boost::asio::steady_timer> delay;
+        std::unique_ptr<Results> late;
+        boost::system::error_code late_error;
+        /* set by whichever of handler and the late answer comes first, the second runs more */
+        std::atomic<bool> handoff;
     };
 
-    template<class Callback>
-    void AsyncGetHostByNameInternal(const std::string &domain, int family, Callback &&cb) {
-        auto comp = std::make_unique<ChannelComplete>();
+    using InflightKey = std::pair<const char *, int>;
+
+    struct InflightCompare {
+        bool operator()(const InflightKey &lhs, const InflightKey &rhs) const {
+            if (lhs.second != rhs.second) {
+                return lhs.second < rhs.second;
+            }
+            return strcmp(lhs.first, rhs.first) < 0;
+        }
+    };
+
+    struct ChannelComplete;
+
+    static constexpr size_t kMaxHedgeAttempts = 4;
+
+    struct Upstream;
+
+    /* one copy of a hedged query, sent to upstream */
+    struct HedgeAttempt {
+        ChannelComplete *comp = nullptr;
+        Upstream *upstream = nullptr;
+        std::chrono::steady_clock::time_point sent;
+        bool pending = false;
+    };
+
+    /* one per outstanding query, shared by every caller asking the same (name, family) */
+    struct ChannelComplete : public boost::intrusive::set_base_hook<> {
+        Channel *channel = nullptr;
+        QueryWaiter *waiters = nullptr;
+        QueryWaiter **waiters_tail = &waiters;
+        ChannelComplete *next_free = nullptr;
+        bool done = false;
+
+        /*
+         * Hedging only. The entry is recycled once the query is done and
+         * neither attempts nor hedge timer waits are left.
+         */
+        HedgeAttempt attempts[kMaxHedgeAttempts];
+        size_t attempts_sent = 0;
+        size_t attempts_pending = 0;
+        unsigned hedge_waits = 0;
+        unsigned busy = 0;
+        std::unique_ptr<boost::asio::steady_timer> hedge_timer;
+    };
+
+    /* a single-server handle used for hedging, with that server's history */
+    struct Upstream {
+        struct ares_addr_port_node server;
+        native_handle_type handle;
+        UpstreamHealth health;
+    };
+
+    /* the key is borrowed from the first waiter, which outlives the set entry */
+    struct CompleteKey {
+        using type = InflightKey;
+
+        type operator()(const ChannelComplete &comp) const {
+            return InflightKey{comp.waiters->domain, comp.waiters->family};
+        }
+    };
+
+    using inflight_set = boost::intrusive::set<
+        ChannelComplete,
+        boost::intrusive::key_of_value<CompleteKey>,
+        boost::intrusive::compare<InflightCompare>
+    >;
+
+    /*
+     * c-ares is not thread safe, so callers only enqueue their query here and
+     * everything touching channel_ runs on strand_.
+     */
+    template<class Request>
+    void AsyncGetHostByNameInternal(std::shared_ptr<Request> request, QueryWaiter &waiter, int family) {
+        waiter.domain = request->domain;
+        waiter.family = family;
+        waiter.owner = std::move(request);
+        submissions_.Push(&waiter);
+        if (!drain_scheduled_.exchange(true)) {
+            auto self{shared_from_this()};
+            boost::asio::post(strand_, [this, self]() { DrainSubmissions(); });
+        }
+    }
+
+    void DrainSubmissions() {
+        drain_scheduled_ = false;
+        while (auto waiter = submissions_.Pop()) {
+            Submit(waiter);
+        }
+        TimerUpdate();
+    }
+
+    void Submit(QueryWaiter *waiter) {
+        waiter->next_waiter = nullptr;
+        auto itr = inflight_.find(InflightKey{waiter->domain, waiter->family});
+        if (itr != inflight_.end()) {
+            *itr->waiters_tail = waiter;
+            itr->waiters_tail = &waiter->next_waiter;
+            stats_.OnCoalesced();
+            return;
+        }
+
+        auto comp = AllocateComplete();
+        comp->waiters = waiter;
+        comp->waiters_tail = &waiter->next_waiter;
+        inflight_.insert(*comp);
+        stats_.OnQuery(waiter->family);
+
+        if (upstreams_.empty()) {
+            ++request_count_;
+            GetAddrInfo(channel_, waiter, &Channel::HostCallback, comp);
+        } else {
+            SendAttempt(comp);
+        }
+    }
+
+    static void GetAddrInfo(native_handle_type handle, const QueryWaiter *waiter, ares_addrinfo_callback callback, void *arg) {
+        struct ares_addrinfo_hints hints;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = waiter->family;
+        hints.ai_flags = ARES_AI_NOSORT;
+        ::ares_getaddrinfo(handle, waiter->domain, nullptr, &hints, callback, arg);
+    }
+
+    /*
+     * Sends the query to the best upstream not asked yet, healthy ones
+     * first and then by smoothed rtt, and arms the timer for the next copy.
+     */
+    bool SendAttempt(ChannelComplete *comp) {
+        size_t limit = std::min(hedge_options_.max_attempts, upstreams_.size());
+        if (limit > kMaxHedgeAttempts) {
+            limit = kMaxHedgeAttempts;
+        }
+        if (comp->attempts_sent >= limit) {
+            return false;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        Upstream *best = nullptr;
+        for (auto &upstream : upstreams_) {
+            auto candidate = upstream.get();
+            auto tried = std::any_of(
+                comp->attempts, comp->attempts + comp->attempts_sent,
+                [candidate](const HedgeAttempt &attempt) { return attempt.upstream == candidate; }
+            );
+            if (!tried && (!best || candidate->health.IsBetterThan(best->health, now))) {
+                best = candidate;
+            }
+        }
+        if (!best) {
+            return false;
+        }
+
+        auto &attempt = comp->attempts[comp->attempts_sent++];
+        attempt.comp = comp;
+        attempt.upstream = best;
+        attempt.sent = now;
+        attempt.pending = true;
+        if (comp->attempts_sent > 1) {
+            stats_.OnHedge();
+        }
+        ++comp->attempts_pending;
+        ++request_count_;
+        /* the callback may run synchronously, keep comp until we are done with it */
+        ++comp->busy;
+        GetAddrInfo(best->handle, comp->waiters, &Channel::HedgeCallback, &attempt);
+        --comp->busy;
+        if (!comp->done && comp->attempts_sent < limit) {
+            ArmHedge(comp, best->health);
+        }
+        MaybeRelease(comp);
+        return true;
+    }
+
+    void ArmHedge(ChannelComplete *comp, const UpstreamHealth &health) {
+        std::chrono::steady_clock::duration delay = hedge_options_.delay;
+        if (hedge_options_.adaptive) {
+            health.P95(delay);
+        }
+        if (!comp->hedge_timer) {
+            comp->hedge_timer.reset(new boost::asio::steady_timer{context_});
+        }
         auto self{shared_from_this()};
-        comp->channel = self;
-        comp->callback = std::move(cb);
-        ::ares_gethostbyname(channel_, domain.c_str(), family, &Channel::HostCallback, comp.release());
-        boost::asio::post(
-            strand_,
-            [this, self]() {
-                if (request_count_ == 0) {
-                    TimerStart();
+        ++comp->hedge_waits;
+        comp->hedge_timer->expires_after(delay);
+        comp->hedge_timer->async_wait(
+            boost::asio::bind_executor(
+                strand_,
+                [this, self, comp](boost::system::error_code ec) {
+                    --comp->hedge_waits;
+                    if (ec != boost::asio::error::operation_aborted && !comp->done) {
+                        SendAttempt(comp);
+                        TimerUpdate();
+                    }
+                    MaybeRelease(comp);
                 }
-                ++request_count_;
-            }
+            )
         );
     }
 
-    template<class Results, class Callback>
-    void ResultHandler(boost::system::error_code ec, struct hostent *entries, std::shared_ptr<Results> &result, std::shared_ptr<Callback> cb, std::shared_ptr<uint32_t> req) {
+    void MaybeRelease(ChannelComplete *comp) {
+        if (comp->done && comp->attempts_pending == 0 && comp->hedge_waits == 0 && comp->busy == 0) {
+            ReleaseComplete(comp);
+        }
+    }
+
+    ChannelComplete *AllocateComplete() {
+        ChannelComplete *comp = free_completes_;
+        if (comp) {
+            free_completes_ = comp->next_free;
+        } else {
+            comp = new ChannelComplete;
+            comp->channel = this;
+        }
+        return comp;
+    }
+
+    void ReleaseComplete(ChannelComplete *comp) {
+        comp->waiters = nullptr;
+        comp->waiters_tail = &comp->waiters;
+        comp->done = false;
+        comp->attempts_sent = 0;
+        comp->next_free = free_completes_;
+        free_completes_ = comp;
+    }
+
+    template<class Request>
+    void ResultHandler(boost::system::error_code ec, const struct ares_addrinfo *entries, int query_family, std::shared_ptr<Request> &request) {
         int family;
         bool need_prepend = false;
-        auto mode = GetResolveMode();
+        auto mode = request->mode;
+        auto &result = request->result;
+        auto &req = request->remain;
         bool should_invoke_cb = false;
-        --*req;
+        --req;
+        if (mode == happy_eyeballs) {
+            HappyEyeballsHandler(ec, entries, query_family, request);
+            return;
+        }
+        if (request->delivered) {
+            return;
+        }
         switch (mode) {
         case unspecific:
-            if (!result->IsEmpty()) {
+            if (!result.IsEmpty()) {
                 break;
             }
-            if (!ec && result->IsEmpty()) {
-                result->Append(entries);
+            if (!ec && result.IsEmpty()) {
+                result.Append(entries);
             }
-            if (!result->IsEmpty() || *req == 0) {
+            if (!result.IsEmpty() || req == 0) {
                 should_invoke_cb = true;
             }
             break;
@@ -273,16 +670,19 @@ private:
         case ipv4_first:
         case ipv6_first:
         case both:
-            need_prepend = (mode != both) && result->LastFamily(family);
+            if (ec && !error::is_negative_answer(ec)) {
+                result.MarkPartial();
+            }
+            need_prepend = (mode != both) && result.LastFamily(family);
             need_prepend = \
                 need_prepend && (family == (mode == ipv4_first ? AF_INET6 : AF_INET));
             if (!ec && !need_prepend) {
-                result->Append(entries);
+                result.Append(entries);
             } else if (!ec && need_prepend) {
-                result->Prepend(entries);
+                result.Prepend(entries);
             }
-            if (*req == 0) {
-                if (!result->IsEmpty()) {
+            if (req == 0) {
+                if (!result.IsEmpty()) {
                     ec.clear();
                 }
                 should_invoke_cb = true;
@@ -292,7 +692,7 @@ private:
         case ipv4_only:
         case ipv6_only:
             if (!ec) {
-                result->Append(entries);
+                result.Append(entries);
             }
             should_invoke_cb = true;
             break;
@@ -302,39 +702,155 @@ private:
             break;
         };
         if (should_invoke_cb) {
-            boost::asio::post(
-                context_,
-                [cb, ec, result]() {
-                    (*cb)(ec, *result);
-                }
+            Deliver(ec, std::move(request));
+        }
+    }
+
+    /*
+     * RFC 8305 section 3: A and AAAA go out together, an AAAA answer is
+     * delivered at once while an A answer waits up to resolution_delay_ for
+     * AAAA. Whatever lands after delivery is passed to request->more.
+     */
+    template<class Request>
+    void HappyEyeballsHandler(boost::system::error_code ec, const struct ares_addrinfo *entries, int family, const std::shared_ptr<Request> &request) {
+        auto &result = request->result;
+        if (request->delivered) {
+            DeliverMore(ec, entries, request);
+            return;
+        }
+
+        if (ec && !error::is_negative_answer(ec)) {
+            result.MarkPartial();
+        }
+        if (!ec && family == AF_INET6) {
+            result.Prepend(entries);
+        } else if (!ec) {
+            result.Append(entries);
+        }
+
+        if (request->remain == 0 || (!ec && family == AF_INET6)) {
+            if (request->delay) {
+                request->delay->cancel();
+            }
+            if (!result.IsEmpty()) {
+                ec.clear();
+            }
+            Deliver(ec, request);
+        } else if (!ec) {
+            request->delay.reset(new boost::asio::steady_timer{context_, GetResolutionDelay()});
+            request->delay->async_wait(
+                boost::asio::bind_executor(
+                    strand_,
+                    [request](boost::system::error_code ec) {
+                        if (ec != boost::asio::error::operation_aborted && !request->delivered) {
+                            request->channel->Deliver(boost::system::error_code{}, request);
+                        }
+                    }
+                )
             );
         }
     }
 
-    void TimerStart() {
-        auto self{shared_from_this()};
-        last_tick_ = boost::posix_time::microsec_clock::local_time();
-        timer_.expires_from_now(timer_period_);
-        timer_.async_wait(std::bind(&Channel::TimerCallback, self, std::placeholders::_1));
+    template<class Request>
+    void DeliverMore(boost::system::error_code ec, const struct ares_addrinfo *entries, const std::shared_ptr<Request> &request) {
+        if (!Request::has_more) {
+            return;
+        }
+        request->late.reset(new typename std::decay<decltype(request->result)>::type{request->port});
+        if (!ec) {
+            request->late->Append(entries);
+        }
+        request->late_error = ec;
+        if (request->handoff.exchange(true)) {
+            boost::asio::post(context_, [request]() { request->InvokeMore(); });
+        }
     }
 
-    void TimerStop() {
-        timer_.cancel();
+    template<class Request>
+    void Deliver(boost::system::error_code ec, std::shared_ptr<Request> request) {
+        request->delivered = true;
+        stats_.OnResolved(request->mode, ChannelStats::clock_type::now() - request->started);
+        boost::asio::post(
+            context_,
+            [request = std::move(request), ec]() mutable {
+                Upcall(std::move(request), ec);
+            }
+        );
     }
 
-    void TimerCallback(boost::system::error_code ec) {
-        auto self{shared_from_this()};
-        auto now = boost::posix_time::microsec_clock::local_time();
-        auto after = last_tick_ - now + timer_period_;
-        if (after.is_negative() || after == boost::posix_time::millisec{0}) {
-            last_tick_ = boost::posix_time::microsec_clock::local_time();
-            ProcessFd(ARES_SOCKET_BAD, ARES_SOCKET_BAD);
-            after = timer_period_;
+    /*
+     * Moves the handler and result out first. Unless more still has to
+     * run, this drops what should be the last reference to the request
+     * before calling the handler.
+     */
+    template<class Request>
+    static void Upcall(std::shared_ptr<Request> request, boost::system::error_code ec) {
+        auto handler{std::move(request->handler)};
+        auto result{std::move(request->result)};
+        if (Request::has_more && request->handoff.exchange(true)) {
+            handler(ec, std::move(result));
+            request->InvokeMore();
+            return;
+        }
+        request.reset();
+        handler(ec, std::move(result));
+    }
+
+    void AddSocket(ares_socket_t fd, std::shared_ptr<Socket> socket) {
+        if (static_cast<size_t>(fd) >= sockets_.size()) {
+            sockets_.resize(fd + 1);
+        }
+        sockets_[fd] = std::move(socket);
+    }
+
+    /*
+     * Arm the timer for the next deadline c-ares reports. A later deadline
+     * leaves the pending wait alone, it simply fires early and re-arms.
+     */
+    void TimerUpdate() {
+        PruneRetired();
+        struct timeval buf[2];
+        struct timeval *next = nullptr;
+        if (request_count_ != 0) {
+            /* each call may return its own buffer, so alternate between two */
+            ForEachHandle([&buf, &next](native_handle_type handle) {
+                auto tv = ::ares_timeout(handle, next, &buf[next == &buf[0]]);
+                next = tv;
+            });
         }
-        if (!ec && request_count_) {
-            timer_.expires_from_now(after);
-            timer_.async_wait(std::bind(&Channel::TimerCallback, self, std::placeholders::_1));
+        if (!next) {
+            if (timer_armed_) {
+                timer_armed_ = false;
+                timer_.cancel();
+            }
+            return;
         }
+
+        auto expiry = std::chrono::steady_clock::now()
+                    + std::chrono::seconds{next->tv_sec} + std::chrono::microseconds{next->tv_usec};
+        if (timer_armed_ && timer_.expiry() <= expiry) {
+            return;
+        }
+
+        auto self{shared_from_this()};
+        timer_armed_ = true;
+        timer_.expires_at(expiry);
+        timer_.async_wait(
+            boost::asio::bind_executor(
+                strand_, std::bind(&Channel::TimerCallback, self, std::placeholders::_1)
+            )
+        );
+    }
+
+    void TimerCallback(boost::system::error_code ec) {
+        if (ec == boost::asio::error::operation_aborted) {
+            return;
+        }
+        timer_armed_ = false;
+        ForEachHandle([](native_handle_type handle) {
+            ::ares_process_fd(handle, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+        });
+        TimerUpdate();
     }
 
     void ProcessFd(ares_socket_t rd, ares_socket_t wr) {
@@ -342,42 +858,283 @@ private:
         boost::asio::post(
             strand_,
             [this, self, rd, wr]() {
-                last_tick_ = boost::posix_time::microsec_clock::local_time();
-                ::ares_process_fd(channel_, rd, wr);
+                /* sockets are shared by fd, the owning handle picks its own up */
+                ForEachHandle([rd, wr](native_handle_type handle) {
+                    ::ares_process_fd(handle, rd, wr);
+                });
+                TimerUpdate();
             }
         );
     }
 
-    static void HostCallback(void *arg, int status, int timeouts, struct hostent *hostent) {
-        std::unique_ptr<ChannelComplete> comp;
-        comp.reset(static_cast<ChannelComplete *>(arg));
+    static void HostCallback(void *arg, int status, int timeouts, struct ares_addrinfo *info) {
+        std::unique_ptr<struct ares_addrinfo, decltype(&::ares_freeaddrinfo)> guard{info, &::ares_freeaddrinfo};
+        auto comp = static_cast<ChannelComplete *>(arg);
+        auto channel = comp->channel;
+        --channel->request_count_;
+        channel->Finish(comp, status, timeouts, info);
+        channel->ReleaseComplete(comp);
+    }
+
+    /*
+     * The first valid answer, positive or negative, wins. A failed attempt
+     * moves on to the next upstream at once, the last error is only
+     * reported when no attempt is left.
+     */
+    static void HedgeCallback(void *arg, int status, int timeouts, struct ares_addrinfo *info) {
+        std::unique_ptr<struct ares_addrinfo, decltype(&::ares_freeaddrinfo)> guard{info, &::ares_freeaddrinfo};
+        auto attempt = static_cast<HedgeAttempt *>(arg);
+        auto comp = attempt->comp;
+        auto channel = comp->channel;
+        --channel->request_count_;
+        --comp->attempts_pending;
+        attempt->pending = false;
+
+        bool valid = status == ARES_SUCCESS || status == ARES_ENOTFOUND || status == ARES_ENODATA;
+        bool terminal = status == ARES_ECANCELLED || status == ARES_EDESTRUCTION;
+        auto &health = attempt->upstream->health;
+        auto now = std::chrono::steady_clock::now();
+        if (valid) {
+            health.OnAnswer(now - attempt->sent);
+        } else if (!terminal) {
+            health.OnFailure(channel->hedge_options_, now);
+        }
+
+        if (comp->done) {
+            channel->stats_.OnTimeouts(timeouts);
+        } else if (valid || terminal) {
+            /* a failover after an earlier attempt failed beat nobody */
+            auto beat_earlier = std::any_of(
+                comp->attempts, attempt, [](const HedgeAttempt &earlier) { return earlier.pending; }
+            );
+            if (valid && beat_earlier) {
+                channel->stats_.OnHedgeWin();
+            }
+            channel->Finish(comp, status, timeouts, info);
+        } else if (!channel->SendAttempt(comp) && comp->attempts_pending == 0) {
+            channel->Finish(comp, status, timeouts, info);
+        } else {
+            channel->stats_.OnTimeouts(timeouts);
+        }
+        channel->MaybeRelease(comp);
+    }
+
+    void Finish(ChannelComplete *comp, int status, int timeouts, const struct ares_addrinfo *info) {
+        auto waiter = comp->waiters;
+        comp->done = true;
+        if (comp->hedge_waits) {
+            comp->hedge_timer->cancel();
+        }
+        inflight_.erase(inflight_.iterator_to(*comp));
+        stats_.OnQueryDone(waiter->family, status, timeouts);
+
         boost::system::error_code ec;
         if (status != ARES_SUCCESS) {
             ec.assign(status, error::get_category());
         }
-        comp->callback(ec, hostent);
-        auto channel = comp->channel;
-        boost::asio::post(
-            channel->strand_,
-            [comp{std::move(comp)}]() {
-                comp->channel->request_count_--;
-                if (comp->channel->request_count_ == 0) {
-                    comp->channel->TimerStop();
+        while (waiter) {
+            auto next = waiter->next_waiter;
+            waiter->Complete(ec, info);
+            waiter = next;
+        }
+    }
+
+    int InitHandle(native_handle_type &handle) {
+        struct ares_options option;
+        memset(&option, 0, sizeof option);
+        option.sock_state_cb = SocketStateCb;
+        option.sock_state_cb_data = this;
+        option.timeout = timeout_.total_milliseconds();
+        option.tries = 1;
+        option.lookups = GetAresLookups();
+        int mask = ARES_OPT_NOROTATE | ARES_OPT_TIMEOUTMS | ARES_OPT_SOCK_STATE_CB | ARES_OPT_TRIES | ARES_OPT_LOOKUPS;
+
+        int ret = ::ares_init_options(&handle, &option, mask);
+        if (ret == ARES_SUCCESS) {
+            ::ares_set_socket_functions(handle, functions_.get(), this);
+        }
+        return ret;
+    }
+
+    /* channel_, every upstream, then the retired ones still draining */
+    template<class Function>
+    void ForEachHandle(Function &&f) {
+        f(channel_);
+        for (auto &upstream : upstreams_) {
+            f(upstream->handle);
+        }
+        for (auto &upstream : retired_upstreams_) {
+            f(upstream->handle);
+        }
+        for (auto handle : retired_) {
+            f(handle);
+        }
+    }
+
+    static int ValidateServers(const std::string &servers) {
+        native_handle_type scratch;
+        struct ares_options option;
+        memset(&option, 0, sizeof option);
+        int ret = ::ares_init_options(&scratch, &option, 0);
+        if (ret == ARES_SUCCESS) {
+            ret = ::ares_set_servers_ports_csv(scratch, servers.c_str());
+            ::ares_destroy(scratch);
+        }
+        return ret;
+    }
+
+    /*
+     * c-ares refuses new servers while queries are pending, so a busy
+     * channel_ is retired and replaced by a fresh handle instead.
+     */
+    void ApplyServers(const std::string &servers) {
+        if (::ares_set_servers_ports_csv(channel_, servers.c_str()) == ARES_ENOTIMP) {
+            native_handle_type handle;
+            if (InitHandle(handle) == ARES_SUCCESS) {
+                if (::ares_set_servers_ports_csv(handle, servers.c_str()) == ARES_SUCCESS) {
+                    retired_.push_back(channel_);
+                    channel_ = handle;
+                } else {
+                    ::ares_destroy(handle);
                 }
             }
+        }
+        BuildUpstreams();
+        TimerUpdate();
+    }
+
+    /* only from the top of a strand handler, never inside a c-ares callback */
+    void PruneRetired() {
+        retired_.erase(
+            std::remove_if(
+                retired_.begin(), retired_.end(),
+                [](native_handle_type handle) {
+                    if (IsBusy(handle)) {
+                        return false;
+                    }
+                    ::ares_destroy(handle);
+                    return true;
+                }
+            ),
+            retired_.end()
         );
+        retired_upstreams_.erase(
+            std::remove_if(
+                retired_upstreams_.begin(), retired_upstreams_.end(),
+                [](const std::unique_ptr<Upstream> &upstream) {
+                    if (IsBusy(upstream->handle)) {
+                        return false;
+                    }
+                    ::ares_destroy(upstream->handle);
+                    return true;
+                }
+            ),
+            retired_upstreams_.end()
+        );
+    }
+
+    /* c-ares only reports a deadline while the handle has queries pending */
+    static bool IsBusy(native_handle_type handle) {
+        struct timeval tv;
+        return ::ares_timeout(handle, nullptr, &tv) != nullptr;
+    }
+
+    /*
+     * Hedging needs a handle per server since c-ares cannot pick the server
+     * of a single query. The servers are read back from channel_, so the
+     * ones from resolv.conf hedge just like those given to set_servers.
+     * With hedging off or fewer than two servers every query keeps using
+     * channel_ and its failover list.
+     *
+     * Servers still listed keep their handle and history. The others are
+     * retired, in-flight attempts finish on them before they are destroyed.
+     */
+    void BuildUpstreams() {
+        std::vector<std::unique_ptr<Upstream>> upstreams;
+        struct ares_addr_port_node *servers = nullptr;
+        bool failed = false;
+        if (hedge_options_.delay.count() != 0) {
+            failed = ::ares_get_servers_ports(channel_, &servers) != ARES_SUCCESS;
+        }
+        std::unique_ptr<struct ares_addr_port_node, decltype(&::ares_free_data)> guard{servers, &::ares_free_data};
+        for (auto server = servers; server && !failed; server = server->next) {
+            auto kept = std::find_if(
+                upstreams_.begin(), upstreams_.end(),
+                [server](const std::unique_ptr<Upstream> &upstream) {
+                    return upstream && IsSameServer(upstream->server, *server);
+                }
+            );
+            if (kept != upstreams_.end()) {
+                upstreams.push_back(std::move(*kept));
+                continue;
+            }
+            std::unique_ptr<Upstream> upstream{new Upstream};
+            upstream->server = *server;
+            upstream->server.next = nullptr;
+            int ret = InitHandle(upstream->handle);
+            if (ret == ARES_SUCCESS) {
+                ret = ::ares_set_servers_ports(upstream->handle, &upstream->server);
+                upstreams.push_back(std::move(upstream));
+            }
+            failed = ret != ARES_SUCCESS;
+        }
+        if (failed || upstreams.size() < 2) {
+            Retire(upstreams);
+        }
+        Retire(upstreams_);
+        upstreams_.swap(upstreams);
+    }
+
+    static bool IsSameServer(const struct ares_addr_port_node &lhs, const struct ares_addr_port_node &rhs) {
+        if (lhs.family != rhs.family || lhs.udp_port != rhs.udp_port || lhs.tcp_port != rhs.tcp_port) {
+            return false;
+        }
+        if (lhs.family == AF_INET) {
+            return memcmp(&lhs.addr.addr4, &rhs.addr.addr4, sizeof lhs.addr.addr4) == 0;
+        }
+        return memcmp(&lhs.addr.addr6, &rhs.addr.addr6, sizeof lhs.addr.addr6) == 0;
+    }
+
+    void Retire(std::vector<std::unique_ptr<Upstream>> &upstreams) {
+        for (auto &upstream : upstreams) {
+            if (upstream) {
+                retired_upstreams_.push_back(std::move(upstream));
+            }
+        }
+        upstreams.clear();
+    }
+
+    /* pending attempts complete with ARES_EDESTRUCTION while their upstream is still alive */
+    static void DestroyUpstreams(std::vector<std::unique_ptr<Upstream>> &upstreams) {
+        for (auto &upstream : upstreams) {
+            ::ares_destroy(upstream->handle);
+        }
+        upstreams.clear();
     }
 
     boost::asio::io_context &context_;
     boost::asio::io_context::strand strand_;
     native_handle_type channel_;
-    boost::asio::deadline_timer timer_;
-    boost::posix_time::time_duration timer_period_;
-    boost::posix_time::ptime last_tick_;
+    boost::posix_time::time_duration timeout_;
+    boost::asio::steady_timer timer_;
+    bool timer_armed_;
     std::shared_ptr<struct ares_socket_functions> functions_;
-    std::map<ares_socket_t, std::shared_ptr<Socket>> sockets_;
+    /* indexed by fd */
+    std::vector<std::shared_ptr<Socket>> sockets_;
+    inflight_set inflight_;
+    ChannelComplete *free_completes_;
     int64_t request_count_;
-    resolve_mode resolve_mode_;
+    std::atomic<resolve_mode> resolve_mode_;
+    std::atomic<std::chrono::milliseconds> resolution_delay_;
+    MpscQueue<QueryWaiter> submissions_;
+    std::atomic<bool> drain_scheduled_;
+    ChannelStats stats_;
+    std::shared_ptr<ResultCache> cache_;
+    hedge_options hedge_options_;
+    std::vector<std::unique_ptr<Upstream>> upstreams_;
+    /* handles replaced by set_servers or hedge changes, destroyed once their queries are done */
+    std::vector<native_handle_type> retired_;
+    std::vector<std::unique_ptr<Upstream>> retired_upstreams_;
 
     friend ares_socket_t OpenSocket(int family, int type, int protocol, void *arg);
     friend int CloseSocket(ares_socket_t fd, void *arg);
@@ -422,8 +1179,8 @@ ares_socket_t OpenSocket(int family, int type, int protocol, void *arg) {
         if (ec) { goto __open_socket_final_state; }
 
         result = sock.native_handle();
-        auto ptr = std::make_shared<Channel::Socket>(std::move(sock));
-        channel->sockets_.emplace(result, ptr);
+        channel->AddSocket(result, std::make_shared<Channel::Socket>(std::move(sock), channel->strand_));
+        channel->stats_.OnSocketOpened(true);
     } else if (type == SOCK_DGRAM) {
         boost::asio::ip::udp::socket sock{context};
         auto af = (family == AF_INET) ? boost::asio::ip::udp::v4() : boost::asio::ip::udp::v6();
@@ -434,8 +1191,8 @@ ares_socket_t OpenSocket(int family, int type, int protocol, void *arg) {
         if (ec) { goto __open_socket_final_state; }
 
         result = sock.native_handle();
-        auto ptr = std::make_shared<Channel::Socket>(std::move(sock));
-        channel->sockets_.emplace(result, ptr);
+        channel->AddSocket(result, std::make_shared<Channel::Socket>(std::move(sock), channel->strand_));
+        channel->stats_.OnSocketOpened(false);
     } else {
         assert(false);
     }
@@ -450,17 +1207,16 @@ __open_socket_final_state:
 
 int CloseSocket(ares_socket_t fd, void *arg) {
     auto channel = static_cast<Channel *>(arg);
-    auto &sockets = channel->sockets_;
-    auto itr = sockets.find(fd);
-    itr->second->Close();
-    sockets.erase(itr);
+    auto &self = channel->sockets_[fd];
+    self->Close();
+    self.reset();
+    channel->stats_.OnSocketClosed();
     return 0;
 }
 
 int ConnectSocket(ares_socket_t fd, const struct sockaddr *addr, ares_socklen_t addr_len, void *arg) {
     auto channel = static_cast<Channel *>(arg);
-    auto itr = channel->sockets_.find(fd);
-    auto self{itr->second};
+    auto &self = channel->sockets_[fd];
     boost::system::error_code ec;
 
     if (self->IsTcp()) {
@@ -480,8 +1236,7 @@ int ConnectSocket(ares_socket_t fd, const struct sockaddr *addr, ares_socklen_t
 
 ares_ssize_t ReadSocket(ares_socket_t fd, void *data, size_t data_len, int flags, struct sockaddr *addr, ares_socklen_t *addr_len, void *arg) {
     auto channel = static_cast<Channel *>(arg);
-    auto itr = channel->sockets_.find(fd);
-    auto self{itr->second};
+    auto &self = channel->sockets_[fd];
     boost::system::error_code ec;
 
     ares_ssize_t result = -1;
@@ -508,22 +1263,20 @@ ares_ssize_t ReadSocket(ares_socket_t fd, void *data, size_t data_len, int flags
 
 ares_ssize_t SendSocket(ares_socket_t fd, const struct iovec *data, int len, void *arg) {
     auto channel = static_cast<Channel *>(arg);
-    auto itr = channel->sockets_.find(fd);
-    auto self{itr->second};
+    auto &self = channel->sockets_[fd];
     boost::system::error_code ec;
 
     ares_ssize_t result = -1;
-    std::vector<boost::asio::mutable_buffer> buf_seq;
-    buf_seq.reserve(len);
+    boost::container::small_vector<boost::asio::const_buffer, 4> buf_seq;
     for (int i = 0; i < len; ++i) {
         buf_seq.push_back(boost::asio::buffer(data[i].iov_base, data[i].iov_len));
     }
     if (self->IsTcp()) {
         auto &socket = self->GetTcp();
-        result = socket.write_some(std::move(buf_seq), ec);
+        result = socket.write_some(buf_seq, ec);
     } else {
         auto &socket = self->GetUdp();
-        result = socket.send(std::move(buf_seq), 0, ec);
+        result = socket.send(buf_seq, 0, ec);
     }
     SET_SOCKERRNO(ec.value());
     return (ec ? -1 : result);
@@ -531,8 +1284,7 @@ ares_ssize_t SendSocket(ares_socket_t fd, const struct iovec *data, int len, voi
 
 void SocketStateCb(void *arg, ares_socket_t fd, int readable, int writeable) {
     auto channel = static_cast<Channel *>(arg);
-    auto itr = channel->sockets_.find(fd);
-    auto self{itr->second};
+    auto &self = channel->sockets_[fd];
 
     self->Cancel();
     if (readable) {
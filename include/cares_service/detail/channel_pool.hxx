@@ -0,0 +1,224 @@
+#ifndef __CARES_SERVICES_CHANNEL_POOL_HXX__
+#define __CARES_SERVICES_CHANNEL_POOL_HXX__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "cache.hxx"
+#include "channel.hxx"
+#include "error.hxx"
+#include "hedge.hxx"
+#include "resolve_mode.hxx"
+#include "stats.hxx"
+
+namespace cares {
+namespace detail {
+
+/*
+ * N independent Channel shards, each serialized by its own strand.
+ * Queries are dispatched by name hash, so identical names always meet the
+ * same shard and still get coalesced and cached there. Run the io_context
+ * on several threads to let the shards resolve in parallel.
+ */
+class ChannelPool {
+public:
+    using resolve_mode = Channel::resolve_mode;
+    using native_handle_type = Channel::native_handle_type;
+
+    ChannelPool(const ChannelPool &) = delete;
+    explicit ChannelPool(boost::asio::io_context &ios)
+        : context_(ios), shards_(nullptr), resolve_mode_(both), resolution_delay_(std::chrono::milliseconds{50}) {
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        boost::system::error_code ec;
+        BuildShards(std::max(1u, std::thread::hardware_concurrency()), ec);
+    }
+
+    ~ChannelPool() = default;
+
+    template<class Results, class... Handlers>
+    void AsyncGetHostByName(const std::string &domain, Results result, Handlers &&...handlers) {
+        SelectShard(domain)->AsyncGetHostByName(domain, std::move(result), std::forward<Handlers>(handlers)...);
+    }
+
+    /* shards replaced by SetShards may still have queries to cancel */
+    void Cancel() {
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        for (auto &generation : generations_) {
+            for (auto &shard : *generation) {
+                shard->Cancel();
+            }
+        }
+    }
+
+    /* every shard applies the change on its own strand */
+    void SetServerPortsCsv(const std::string &servers, boost::system::error_code &ec) {
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        for (auto &shard : Shards()) {
+            shard->SetServerPortsCsv(servers, ec);
+            if (ec) {
+                return;
+            }
+        }
+        servers_ = servers;
+    }
+
+    void SetHedgeOptions(const hedge_options &options, boost::system::error_code &ec) {
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        for (auto &shard : Shards()) {
+            shard->SetHedgeOptions(options, ec);
+            if (ec) {
+                return;
+            }
+        }
+        hedge_options_ = options;
+    }
+
+    /*
+     * Safe while resolving. The new shards start empty, queries already
+     * sent finish on the old ones.
+     */
+    void SetShards(size_t shards, boost::system::error_code &ec) {
+        ec.clear();
+        if (shards == 0) {
+            ec.assign(error::bad_flags, error::get_category());
+            return;
+        }
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        BuildShards(shards, ec);
+    }
+
+    size_t GetShards() const {
+        return Shards().size();
+    }
+
+    void SetResolveMode(resolve_mode mode, boost::system::error_code &ec) {
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        for (auto &shard : Shards()) {
+            shard->SetResolveMode(mode, ec);
+            if (ec) {
+                return;
+            }
+        }
+        resolve_mode_.store(mode, std::memory_order_relaxed);
+    }
+
+    resolve_mode GetResolveMode() const {
+        return resolve_mode_.load(std::memory_order_relaxed);
+    }
+
+    void SetResolutionDelay(std::chrono::milliseconds delay) {
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        for (auto &shard : Shards()) {
+            shard->SetResolutionDelay(delay);
+        }
+        resolution_delay_.store(delay, std::memory_order_relaxed);
+    }
+
+    std::chrono::milliseconds GetResolutionDelay() const {
+        return resolution_delay_.load(std::memory_order_relaxed);
+    }
+
+    /* sum over all shards, including the ones replaced by SetShards */
+    void CollectStats(resolver_stats &stats) {
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        for (auto &generation : generations_) {
+            for (auto &shard : *generation) {
+                shard->CollectStats(stats);
+            }
+        }
+    }
+
+    /* the cache of the shard the name hashes to, so shards never share a lock */
+    std::shared_ptr<ResultCache> GetCache(const std::string &domain) const {
+        return SelectShard(domain)->GetCache(domain);
+    }
+
+    /* the capacity is split evenly across the shards */
+    void SetCacheOptions(const cache_options &options) {
+        std::lock_guard<std::mutex> lock{config_mutex_};
+        cache_options_ = options;
+        auto &shards = Shards();
+        for (auto &shard : shards) {
+            shard->SetCacheOptions(ShardCacheOptions(shards.size()));
+        }
+    }
+
+    void ClearCache() {
+        for (auto &shard : Shards()) {
+            shard->ClearCache();
+        }
+    }
+
+    /* handle of the first shard, the others are configured identically */
+    native_handle_type GetNativeHandle() {
+        return Shards().front()->GetNativeHandle();
+    }
+
+private:
+    using shard_list = std::vector<std::shared_ptr<Channel>>;
+
+    /* with config_mutex_ held, the new list is fully configured before it is published */
+    void BuildShards(size_t count, boost::system::error_code &ec) {
+        std::unique_ptr<shard_list> shards{new shard_list};
+        shards->reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            auto shard = std::make_shared<Channel>(context_);
+            shard->SetResolveMode(GetResolveMode(), ec);
+            shard->SetResolutionDelay(GetResolutionDelay());
+            shard->SetCacheOptions(ShardCacheOptions(count));
+            shard->SetHedgeOptions(hedge_options_, ec);
+            if (!servers_.empty() && !ec) {
+                shard->SetServerPortsCsv(servers_, ec);
+            }
+            shards->emplace_back(std::move(shard));
+        }
+        shards_.store(shards.get(), std::memory_order_release);
+        if (!generations_.empty()) {
+            /* the old shards get no new names, drop what they cached */
+            for (auto &shard : *generations_.back()) {
+                shard->SetCacheOptions(cache_options{});
+            }
+        }
+        generations_.emplace_back(std::move(shards));
+    }
+
+    cache_options ShardCacheOptions(size_t count) const {
+        auto options = cache_options_;
+        options.capacity = (options.capacity + count - 1) / count;
+        return options;
+    }
+
+    const shard_list &Shards() const {
+        return *shards_.load(std::memory_order_acquire);
+    }
+
+    const std::shared_ptr<Channel> &SelectShard(const std::string &domain) const {
+        auto &shards = Shards();
+        return shards[std::hash<std::string>{}(domain) % shards.size()];
+    }
+
+    boost::asio::io_context &context_;
+    /* read without a lock, a published list is never freed before the pool */
+    std::atomic<const shard_list *> shards_;
+    std::atomic<resolve_mode> resolve_mode_;
+    std::atomic<std::chrono::milliseconds> resolution_delay_;
+    /* guards the settings below, re-applied when the shards are rebuilt */
+    std::mutex config_mutex_;
+    std::string servers_;
+    hedge_options hedge_options_;
+    cache_options cache_options_;
+    /* every list ever published, the current one last */
+    std::vector<std::unique_ptr<const shard_list>> generations_;
+};
+
+} // namespace detail
+} // namespace cares
+
+#endif // __CARES_SERVICES_CHANNEL_POOL_HXX__
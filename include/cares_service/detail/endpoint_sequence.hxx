@@ -1,10 +1,11 @@
 #ifndef __CARES_SERVICES_EPSEQ_HXX__
 #define __CARES_SERVICES_EPSEQ_HXX__
 
-#include <list>
-#include <memory>
+#include <cstring>
+#include <limits>
 #include <ares.h>
 #include <boost/asio.hpp>
+#include <boost/container/small_vector.hpp>
 
 namespace cares {
 namespace detail {
@@ -14,12 +15,14 @@ class EndpointSequence {
     using address = boost::asio::ip::address;
 public:
     using endpoint = boost::asio::ip::basic_endpoint<Protocol>;
-    using sequence = std::list<endpoint>;
+    /* typical dual-stack answers fit inline, larger ones spill to the heap */
+    using sequence = boost::container::small_vector<endpoint, 8>;
     using iterator = typename sequence::iterator;
     using const_iterator = typename sequence::const_iterator;
 
     explicit EndpointSequence(uint16_t port)
-        : endpoints_(std::make_shared<sequence>()), last_family_(AF_UNSPEC), port_(port) {
+        : last_family_(AF_UNSPEC),
+          min_ttl_(std::numeric_limits<int>::max()), port_(port), partial_(false) {
     }
 
     EndpointSequence(const struct hostent *entries, uint16_t port)
@@ -28,21 +31,31 @@ public:
     }
 
     EndpointSequence(const EndpointSequence &) = default;
+    EndpointSequence(EndpointSequence &&) = default;
+    EndpointSequence &operator=(const EndpointSequence &) = default;
+    EndpointSequence &operator=(EndpointSequence &&) = default;
 
     ~EndpointSequence() = default;
 
     void Append(const struct hostent *entries) {
-        sequence subseq;
-        BuildList(entries, subseq);
-        if (!subseq.empty()) {
+        auto size = endpoints_.size();
+        BuildList(entries, endpoints_);
+        if (endpoints_.size() != size) {
             last_family_ = entries->h_addrtype;
-            endpoints_->splice(endpoints_->end(), subseq);
+        }
+    }
+
+    void Append(const struct ares_addrinfo *info) {
+        auto size = endpoints_.size();
+        int family = BuildList(info, endpoints_);
+        if (endpoints_.size() != size) {
+            last_family_ = family;
         }
     }
 
     void Append(boost::asio::ip::address address) {
         last_family_ = (address.is_v4() ? AF_INET : AF_INET6);
-        endpoints_->emplace_back(std::move(address), port_);
+        endpoints_.emplace_back(std::move(address), port_);
     }
 
     void Prepend(const struct hostent *entries) {
@@ -50,7 +63,16 @@ public:
         BuildList(entries, subseq);
         if (!subseq.empty()) {
             last_family_ = entries->h_addrtype;
-            endpoints_->splice(endpoints_->begin(), subseq);
+            endpoints_.insert(endpoints_.begin(), subseq.begin(), subseq.end());
+        }
+    }
+
+    void Prepend(const struct ares_addrinfo *info) {
+        sequence subseq;
+        int family = BuildList(info, subseq);
+        if (!subseq.empty()) {
+            last_family_ = family;
+            endpoints_.insert(endpoints_.begin(), subseq.begin(), subseq.end());
         }
     }
 
@@ -62,24 +84,46 @@ public:
         return true;
     }
 
+    /* smallest ttl (in seconds) of the records appended from ares_addrinfo */
+    bool MinTtl(int &ttl) const {
+        if (min_ttl_ == std::numeric_limits<int>::max()) {
+            return false;
+        }
+        ttl = min_ttl_;
+        return true;
+    }
+
+    /* some queried family failed, so the records are incomplete */
+    void MarkPartial() {
+        partial_ = true;
+    }
+
+    bool IsPartial() const {
+        return partial_;
+    }
+
+    uint16_t Port() const {
+        return port_;
+    }
+
     bool IsEmpty() const {
-        return endpoints_->empty();
+        return endpoints_.empty();
     }
 
     iterator begin() {
-        return endpoints_->begin();
+        return endpoints_.begin();
     }
 
     const_iterator begin() const {
-        return endpoints_->begin();
+        return endpoints_.begin();
     }
 
     iterator end() {
-        return endpoints_->end();
+        return endpoints_.end();
     }
 
     const_iterator end() const {
-        return endpoints_->end();
+        return endpoints_.end();
     }
 
     bool empty() const {
@@ -89,7 +133,6 @@ public:
 private:
     void BuildList(const struct hostent *entries, sequence &subseq) {
         address addr;
-        subseq.clear();
         for (char **p = entries->h_addr_list; *p; ++p) {
             if (entries->h_addrtype == AF_INET) {
                 boost::asio::ip::address_v4::bytes_type bytes;
@@ -106,9 +149,36 @@ private:
         }
     }
 
-    std::shared_ptr<sequence> endpoints_;
+    int BuildList(const struct ares_addrinfo *info, sequence &subseq) {
+        int family = AF_UNSPEC;
+        for (auto cname = info->cnames; cname; cname = cname->next) {
+            min_ttl_ = std::min(min_ttl_, cname->ttl);
+        }
+        for (auto node = info->nodes; node; node = node->ai_next) {
+            if (node->ai_family == AF_INET) {
+                auto sin = reinterpret_cast<const struct sockaddr_in *>(node->ai_addr);
+                boost::asio::ip::address_v4::bytes_type bytes;
+                memcpy(bytes.data(), &sin->sin_addr, bytes.size());
+                subseq.emplace_back(boost::asio::ip::make_address_v4(bytes), port_);
+            } else if (node->ai_family == AF_INET6) {
+                auto sin6 = reinterpret_cast<const struct sockaddr_in6 *>(node->ai_addr);
+                boost::asio::ip::address_v6::bytes_type bytes;
+                memcpy(bytes.data(), &sin6->sin6_addr, bytes.size());
+                subseq.emplace_back(boost::asio::ip::make_address_v6(bytes, sin6->sin6_scope_id), port_);
+            } else {
+                continue;
+            }
+            family = node->ai_family;
+            min_ttl_ = std::min(min_ttl_, node->ai_ttl);
+        }
+        return family;
+    }
+
+    sequence endpoints_;
     int last_family_;
+    int min_ttl_;
     uint16_t port_;
+    bool partial_;
 };
 
 }; // namespace detail
@@ -57,6 +57,12 @@ enum basic_errors {
     operation_cancelled = ARES_ECANCELLED
 };
 
+/* NXDOMAIN or NODATA, an authoritative answer rather than a failure */
+inline bool is_negative_answer(const boost::system::error_code &ec) {
+    return ec.category() == get_category()
+        && (ec.value() == not_found || ec.value() == no_data);
+}
+
 } // namespace error
 } // namespace cares
 
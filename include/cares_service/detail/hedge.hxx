@@ -0,0 +1,97 @@
+#ifndef __CARES_SERVICES_HEDGE_HXX__
+#define __CARES_SERVICES_HEDGE_HXX__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace cares {
+namespace detail {
+
+struct hedge_options {
+    /* wait before asking the next server, zero disables hedging */
+    std::chrono::milliseconds delay{0};
+    /* once a server has enough samples, wait for its p95 rtt instead of delay */
+    bool adaptive = false;
+    /* servers asked per query, including the first one */
+    size_t max_attempts = 2;
+    /* consecutive failures after which a server is demoted */
+    unsigned failure_threshold = 3;
+    /* how long a demoted server stays behind the healthy ones */
+    std::chrono::seconds demotion{30};
+};
+
+/*
+ * Round trip and failure history of one upstream server. Only touched on
+ * the owning Channel's strand.
+ */
+class UpstreamHealth {
+public:
+    using clock_type = std::chrono::steady_clock;
+    using duration = clock_type::duration;
+
+    static constexpr size_t kSamples = 32;
+    static constexpr size_t kMinSamples = 8;
+
+    UpstreamHealth()
+        : srtt_(0), samples_(0), next_sample_(0), failures_(0) {
+    }
+
+    /* a valid answer, positive or negative */
+    void OnAnswer(duration rtt) {
+        srtt_ = samples_ == 0 ? rtt : srtt_ - srtt_ / 8 + rtt / 8;
+        rtt_[next_sample_] = rtt;
+        next_sample_ = (next_sample_ + 1) % kSamples;
+        if (samples_ < kSamples) {
+            ++samples_;
+        }
+        failures_ = 0;
+    }
+
+    void OnFailure(const hedge_options &options, clock_type::time_point now) {
+        if (++failures_ >= options.failure_threshold) {
+            demoted_until_ = now + options.demotion;
+        }
+    }
+
+    bool IsDemoted(clock_type::time_point now) const {
+        return demoted_until_ > now;
+    }
+
+    duration Srtt() const {
+        return srtt_;
+    }
+
+    bool P95(duration &rtt) const {
+        if (samples_ < kMinSamples) {
+            return false;
+        }
+        duration sorted[kSamples];
+        std::copy(rtt_, rtt_ + samples_, sorted);
+        auto nth = sorted + (samples_ * 95 - 1) / 100;
+        std::nth_element(sorted, nth, sorted + samples_);
+        rtt = *nth;
+        return true;
+    }
+
+    /* healthy before demoted, then the lower smoothed rtt */
+    bool IsBetterThan(const UpstreamHealth &other, clock_type::time_point now) const {
+        if (IsDemoted(now) != other.IsDemoted(now)) {
+            return !IsDemoted(now);
+        }
+        return srtt_ < other.srtt_;
+    }
+
+private:
+    duration srtt_;
+    duration rtt_[kSamples];
+    size_t samples_;
+    size_t next_sample_;
+    unsigned failures_;
+    clock_type::time_point demoted_until_;
+};
+
+} // namespace detail
+} // namespace cares
+
+#endif // __CARES_SERVICES_HEDGE_HXX__
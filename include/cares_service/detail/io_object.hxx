@@ -1,6 +1,7 @@
 #ifndef __CARES_SERVICES_IO_OBJECT_HXX__
 #define __CARES_SERVICES_IO_OBJECT_HXX__
 
+#include <chrono>
 #include <boost/asio.hpp>
 
 namespace cares {
@@ -12,6 +13,10 @@ public:
     using results_type = typename Service::results_type;
     using native_handle_type = typename Service::native_handle_type;
     using resolve_mode_type = typename Service::resolve_mode_type;
+    using cache_options_type = typename Service::cache_options_type;
+    using batch_statistics_type = typename Service::batch_statistics_type;
+    using stats_type = typename Service::stats_type;
+    using hedge_options_type = typename Service::hedge_options_type;
 
     explicit basic_cares_resolver(boost::asio::io_context &context)
         : boost::asio::basic_io_object<Service>(context) {
@@ -22,6 +27,20 @@ public:
         this->get_service().async_resolve(this->get_implementation(), name, port, std::move(cb));
     }
 
+    /* more(ec, results) receives records arriving after cb, happy_eyeballs mode only */
+    template<class Handler, class MoreHandler>
+    void async_resolve(const std::string &name, uint16_t port, Handler cb, MoreHandler more) {
+        this->get_service().async_resolve(this->get_implementation(), name, port, std::move(cb), std::move(more));
+    }
+
+    template<class Range, class ResultHandler, class CompletionHandler>
+    void async_resolve_batch(const Range &queries, size_t max_in_flight, ResultHandler result_handler, CompletionHandler completion_handler) {
+        this->get_service().async_resolve_batch(
+            this->get_implementation(), queries, max_in_flight,
+            std::move(result_handler), std::move(completion_handler)
+        );
+    }
+
     void cancel() {
         this->get_service().cancel(this->get_implementation());
     }
@@ -30,6 +49,19 @@ public:
         this->get_service().set_servers(this->get_implementation(), servers, ec);
     }
 
+    /* send a query to the next server once the current one is slow to answer */
+    void set_hedge_options(const hedge_options_type &options, boost::system::error_code &ec) {
+        this->get_service().set_hedge_options(this->get_implementation(), options, ec);
+    }
+
+    size_t shards() {
+        return this->get_service().shards(this->get_implementation());
+    }
+
+    void shards(size_t shards, boost::system::error_code &ec) {
+        this->get_service().shards(this->get_implementation(), shards, ec);
+    }
+
     resolve_mode_type resolve_mode() {
         return this->get_service().resolve_mode(this->get_implementation());
     }
@@ -42,6 +74,27 @@ public:
         this->get_service().resolve_mode(this->get_implementation(), mode, ec);
     }
 
+    std::chrono::milliseconds resolution_delay() {
+        return this->get_service().resolution_delay(this->get_implementation());
+    }
+
+    void resolution_delay(std::chrono::milliseconds delay) {
+        this->get_service().resolution_delay(this->get_implementation(), delay);
+    }
+
+    /* every resolver has its own answer cache, tied to its servers */
+    void set_cache_options(const cache_options_type &options) {
+        this->get_service().set_cache_options(this->get_implementation(), options);
+    }
+
+    void clear_cache() {
+        this->get_service().clear_cache(this->get_implementation());
+    }
+
+    stats_type stats() {
+        return this->get_service().stats(this->get_implementation());
+    }
+
     native_handle_type native_handle() {
         return this->get_service().native_handle(this->get_implementation());
     }
@@ -0,0 +1,73 @@
+#ifndef __CARES_SERVICES_MPSC_QUEUE_HXX__
+#define __CARES_SERVICES_MPSC_QUEUE_HXX__
+
+#include <atomic>
+
+namespace cares {
+namespace detail {
+
+struct MpscNode {
+    std::atomic<MpscNode *> next{nullptr};
+};
+
+/*
+ * Intrusive lock-free multi-producer single-consumer queue (Vyukov).
+ * Push may be called from any thread, Pop only from the consumer.
+ * Pop may transiently report empty while a concurrent Push is half done.
+ */
+template<class Node>
+class MpscQueue {
+public:
+    MpscQueue()
+        : head_(&stub_), tail_(&stub_) {
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+
+    void Push(Node *node) {
+        PushNode(node);
+    }
+
+    Node *Pop() {
+        MpscNode *tail = tail_;
+        MpscNode *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (!next) {
+                return nullptr;
+            }
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            tail_ = next;
+            return static_cast<Node *>(tail);
+        }
+        if (tail != head_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        PushNode(&stub_);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next) {
+            tail_ = next;
+            return static_cast<Node *>(tail);
+        }
+        return nullptr;
+    }
+
+private:
+    void PushNode(MpscNode *node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        MpscNode *prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    MpscNode stub_;
+    std::atomic<MpscNode *> head_;
+    MpscNode *tail_;
+};
+
+} // namespace detail
+} // namespace cares
+
+#endif // __CARES_SERVICES_MPSC_QUEUE_HXX__
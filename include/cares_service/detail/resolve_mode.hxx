@@ -5,6 +5,7 @@
 #include <vector>
 #include <boost/preprocessor/seq/enum.hpp>
 #include <boost/preprocessor/seq/for_each.hpp>
+#include <boost/preprocessor/seq/size.hpp>
 
 #if defined(__CARES_RESOLVE_STR2MODE) || defined(__CARES_RESOLVE_MODE_SEQ) \
     || defined(__CARES_RESOLVE_MODE_ALLMODES) || defined(__CARES_RESOLVE_MODE_IS_VALID)
@@ -15,12 +16,14 @@ namespace cares {
 namespace detail {
 
 #define __CARES_RESOLVE_MODE_SEQ \
-    (unspecific)(ipv4_first)(ipv4_only)(ipv6_first)(ipv6_only)(both)
+    (unspecific)(ipv4_first)(ipv4_only)(ipv6_first)(ipv6_only)(both)(happy_eyeballs)
 
 enum resolve_mode {
     BOOST_PP_SEQ_ENUM(__CARES_RESOLVE_MODE_SEQ)
 };
 
+constexpr size_t resolve_mode_count = BOOST_PP_SEQ_SIZE(__CARES_RESOLVE_MODE_SEQ);
+
 inline bool resolve_mode_from_string(const std::string &str, resolve_mode &mode) {
 #define __CARES_RESOLVE_STR2MODE(unused, data, elem) \
     do { if (data == BOOST_PP_STRINGIZE(elem)) { mode = elem; return true;} } while (false);
@@ -4,9 +4,13 @@
 #include <memory>
 #include <boost/asio.hpp>
 #include "error.hxx"
+#include "batch.hxx"
+#include "cache.hxx"
 #include "channel.hxx"
 #include "resolve_mode.hxx"
+#include "stats.hxx"
 #include "endpoint_sequence.hxx"
+#include "hedge.hxx"
 
 namespace cares {
 namespace detail {
@@ -19,6 +23,10 @@ public:
     using resolve_handler = std::function<void(boost::system::error_code, results_type)>;
     using native_handle_type = typename ChannelImplementation::native_handle_type;
     using resolve_mode_type = typename ChannelImplementation::resolve_mode;
+    using cache_options_type = cache_options;
+    using batch_statistics_type = batch_statistics;
+    using stats_type = resolver_stats;
+    using hedge_options_type = hedge_options;
 
     static boost::asio::io_context::id id;
 
@@ -53,24 +61,64 @@ public:
 
     template<class Handler>
     void async_resolve(implementation_type &impl, const std::string &name, uint16_t port, Handler &&cb) {
-        auto handler = std::make_shared<Handler>(std::move(cb));
-        auto result = std::make_shared<results_type>(port);
+        async_resolve(impl, name, port, std::forward<Handler>(cb), NoMoreEndpoints{});
+    }
+
+    /*
+     * In happy_eyeballs mode cb may fire with one family only, the records
+     * of the other then follow through more(ec, results). more is never
+     * called when cb already got both families.
+     */
+    template<class Handler, class MoreHandler>
+    void async_resolve(implementation_type &impl, const std::string &name, uint16_t port, Handler &&cb, MoreHandler &&more) {
+        results_type result{port};
 
         boost::system::error_code ec;
         auto address = boost::asio::ip::make_address(name, ec);
         if (!ec) { /* name is already an ip address, no need to resolve */
-            result->Append(std::move(address));
+            result.Append(std::move(address));
             boost::asio::post(
                 get_io_context(),
-                [impl, handler, result]() {
-                    (*handler)(boost::system::error_code{}, *result);
+                [handler = std::move(cb), result = std::move(result)]() mutable {
+                    handler(boost::system::error_code{}, std::move(result));
                 }
             );
+        } else if (auto cache = impl->GetCache(name)) {
+            AsyncResolveCached(impl, std::move(cache), name, std::move(result), std::move(cb), std::move(more));
         } else {
-            impl->AsyncGetHostByName(name, result, handler);
+            impl->AsyncGetHostByName(name, std::move(result), std::move(cb), std::move(more));
         }
     }
 
+    /*
+     * Resolves every (name, port) of queries with at most max_in_flight
+     * outstanding, calling result_handler(ec, name, results) as each lands
+     * and completion_handler(batch_statistics) once all are done.
+     */
+    template<class Range, class ResultHandler, class CompletionHandler>
+    void async_resolve_batch(implementation_type &impl, const Range &queries, size_t max_in_flight,
+                             ResultHandler &&result_handler, CompletionHandler &&completion_handler) {
+        using batch_type = BatchResolve<
+            base_cares_service,
+            typename std::decay<ResultHandler>::type,
+            typename std::decay<CompletionHandler>::type
+        >;
+        auto batch = std::make_shared<batch_type>(
+            *this, impl, batch_type::MakeQueries(queries), max_in_flight,
+            std::forward<ResultHandler>(result_handler),
+            std::forward<CompletionHandler>(completion_handler)
+        );
+        batch->Start();
+    }
+
+    void set_cache_options(implementation_type &impl, const cache_options_type &options) {
+        impl->SetCacheOptions(options);
+    }
+
+    void clear_cache(implementation_type &impl) {
+        impl->ClearCache();
+    }
+
     void cancel(implementation_type &impl) {
         impl->Cancel();
     }
@@ -79,6 +127,19 @@ public:
         impl->SetServerPortsCsv(servers, ec);
     }
 
+    /* takes effect with two or more servers, before or after set_servers */
+    void set_hedge_options(implementation_type &impl, const hedge_options_type &options, boost::system::error_code &ec) {
+        impl->SetHedgeOptions(options, ec);
+    }
+
+    void shards(implementation_type &impl, size_t shards, boost::system::error_code &ec) {
+        impl->SetShards(shards, ec);
+    }
+
+    size_t shards(implementation_type &impl) {
+        return impl->GetShards();
+    }
+
     resolve_mode_type resolve_mode(implementation_type &impl) {
         return impl->GetResolveMode();
     }
@@ -96,10 +157,55 @@ public:
         impl->SetResolveMode(enum_mode, ec);
     }
 
+    std::chrono::milliseconds resolution_delay(implementation_type &impl) {
+        return impl->GetResolutionDelay();
+    }
+
+    void resolution_delay(implementation_type &impl, std::chrono::milliseconds delay) {
+        impl->SetResolutionDelay(delay);
+    }
+
+    /* cheap enough to scrape periodically, only relaxed loads */
+    stats_type stats(implementation_type &impl) {
+        stats_type result;
+        impl->CollectStats(result);
+        return result;
+    }
+
     native_handle_type native_handle(implementation_type &impl) {
         return impl->GetNativeHandle();
     }
 
+private:
+    template<class Handler, class MoreHandler>
+    void AsyncResolveCached(implementation_type &impl, std::shared_ptr<ResultCache> cache, const std::string &name,
+                            results_type result, Handler &&handler, MoreHandler &&more) {
+        boost::system::error_code ec;
+        auto mode = impl->GetResolveMode();
+
+        if (cache->Lookup(name, mode, result, ec)) {
+            boost::asio::post(
+                get_io_context(),
+                [handler = std::move(handler), ec, result = std::move(result)]() mutable {
+                    handler(ec, std::move(result));
+                }
+            );
+            return;
+        }
+
+        auto store = \
+            [cache, name, mode, handler = std::move(handler)](boost::system::error_code ec, results_type result) mutable {
+                cache->Store(name, mode, ec, result);
+                handler(ec, std::move(result));
+            };
+        /* late happy_eyeballs records complete the entry stored above */
+        auto extend = \
+            [cache, name, mode, more = std::move(more)](boost::system::error_code ec, results_type result) mutable {
+                cache->Extend(name, mode, ec, result);
+                more(ec, std::move(result));
+            };
+        impl->AsyncGetHostByName(name, std::move(result), std::move(store), std::move(extend));
+    }
 };
 
 template<class Protocol, class ChannelImplementation>
@@ -0,0 +1,249 @@
+#ifndef __CARES_SERVICES_STATS_HXX__
+#define __CARES_SERVICES_STATS_HXX__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <boost/asio.hpp>
+
+#include "error.hxx"
+#include "resolve_mode.hxx"
+
+namespace cares {
+namespace detail {
+
+/*
+ * Point-in-time copy of a resolver's counters. Query counters are per A/AAAA
+ * lookup actually sent, resolve counters are per async_resolve reaching the
+ * channel (numeric names and cache hits never do).
+ */
+struct resolver_stats {
+    /* index 0 is IPv4 (A), 1 is IPv6 (AAAA) */
+    static constexpr size_t families = 2;
+    /* indexed by cares::error::basic_errors, slot 0 is unused */
+    static constexpr size_t error_slots = error::operation_cancelled + 1;
+    /* bucket i counts resolves finishing in [2^i, 2^(i+1)) microseconds, the last one is open ended */
+    static constexpr size_t latency_buckets = 24;
+
+    uint64_t queries_issued[families] = {};
+    uint64_t queries_completed[families] = {};
+    /* queries attached to an identical one already in flight */
+    uint64_t queries_coalesced = 0;
+    uint64_t resolves_issued[resolve_mode_count] = {};
+    uint64_t resolves_completed[resolve_mode_count] = {};
+    uint64_t errors[error_slots] = {};
+    /* individual attempts that timed out, a retried query may count several */
+    uint64_t timeouts = 0;
+    /* TCP connections opened, c-ares only uses TCP after a truncated UDP answer */
+    uint64_t tcp_fallbacks = 0;
+    /* extra copies of a query sent to another upstream, and how many answered while an earlier one was pending */
+    uint64_t hedges = 0;
+    uint64_t hedge_wins = 0;
+    uint64_t open_sockets = 0;
+    uint64_t in_flight = 0;
+    uint64_t latency[latency_buckets] = {};
+
+    /* upper bound of the bucket holding the q-th quantile, zero without samples */
+    std::chrono::microseconds latency_quantile(double q) const {
+        uint64_t total = 0;
+        for (auto count : latency) {
+            total += count;
+        }
+        if (total == 0) {
+            return std::chrono::microseconds{0};
+        }
+        uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+        size_t i = 0;
+        for (uint64_t seen = latency[0]; seen < rank; seen += latency[++i]) {
+        }
+        return std::chrono::microseconds{int64_t{2} << i};
+    }
+
+    /*
+     * Export hook, calls visitor(name, value) once per counter with dotted
+     * names such as "queries_issued.ipv4", "errors.timeout" or "latency_us.1024"
+     * (the bucket's exclusive upper bound).
+     */
+    template<class Visitor>
+    void visit(Visitor &&visitor) const {
+        static const char *family_names[families] = {"ipv4", "ipv6"};
+        for (size_t i = 0; i < families; ++i) {
+            visitor(std::string{"queries_issued."} + family_names[i], queries_issued[i]);
+            visitor(std::string{"queries_completed."} + family_names[i], queries_completed[i]);
+        }
+        visitor(std::string{"queries_coalesced"}, queries_coalesced);
+
+        auto modes = available_resolve_modes();
+        for (size_t i = 0; i < resolve_mode_count; ++i) {
+            visitor("resolves_issued." + modes[i], resolves_issued[i]);
+            visitor("resolves_completed." + modes[i], resolves_completed[i]);
+        }
+
+        for (size_t i = 1; i < error_slots; ++i) {
+            visitor(std::string{"errors."} + ErrorName(i), errors[i]);
+        }
+        visitor(std::string{"timeouts"}, timeouts);
+        visitor(std::string{"tcp_fallbacks"}, tcp_fallbacks);
+        visitor(std::string{"hedges"}, hedges);
+        visitor(std::string{"hedge_wins"}, hedge_wins);
+        visitor(std::string{"open_sockets"}, open_sockets);
+        visitor(std::string{"in_flight"}, in_flight);
+
+        for (size_t i = 0; i < latency_buckets; ++i) {
+            visitor("latency_us." + std::to_string(uint64_t{2} << i), latency[i]);
+        }
+    }
+
+private:
+    static const char *ErrorName(size_t value) {
+        static const char *names[error_slots] = {
+            "success", "no_data", "malformat", "serve_failed", "not_found",
+            "not_implemented", "query_refused", "bad_query", "bad_name",
+            "bad_family", "bad_response", "connection_refused", "timeout", "eof",
+            "configuration_file_error", "no_memory", "channel_destroyed",
+            "bad_string", "bad_flags", "no_name", "bad_hints", "not_initialized",
+            "iphlpapi_failed", "get_network_params_failed", "operation_cancelled"
+        };
+        return names[value];
+    }
+};
+
+/*
+ * Live counters of one Channel. Every update is a single relaxed atomic
+ * add, readers only ever see a slightly stale but never torn snapshot.
+ */
+class ChannelStats {
+public:
+    using clock_type = std::chrono::steady_clock;
+
+    ChannelStats() = default;
+    ChannelStats(const ChannelStats &) = delete;
+
+    void OnResolve(resolve_mode mode) {
+        Add(resolves_issued_[mode]);
+    }
+
+    void OnResolved(resolve_mode mode, clock_type::duration latency) {
+        Add(resolves_completed_[mode]);
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        size_t bucket = 0;
+        while ((us >>= 1) > 0 && bucket + 1 < resolver_stats::latency_buckets) {
+            ++bucket;
+        }
+        Add(latency_[bucket]);
+    }
+
+    void OnError(int status) {
+        if (status > 0 && static_cast<size_t>(status) < resolver_stats::error_slots) {
+            Add(errors_[status]);
+        }
+    }
+
+    void OnQuery(int family) {
+        Add(queries_issued_[FamilyIndex(family)]);
+        in_flight_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void OnCoalesced() {
+        Add(queries_coalesced_);
+    }
+
+    void OnQueryDone(int family, int status, int timeouts) {
+        Add(queries_completed_[FamilyIndex(family)]);
+        in_flight_.fetch_sub(1, std::memory_order_relaxed);
+        OnTimeouts(timeouts);
+        OnError(status);
+    }
+
+    void OnTimeouts(int timeouts) {
+        if (timeouts > 0) {
+            timeouts_.fetch_add(timeouts, std::memory_order_relaxed);
+        }
+    }
+
+    void OnHedge() {
+        Add(hedges_);
+    }
+
+    void OnHedgeWin() {
+        Add(hedge_wins_);
+    }
+
+    void OnSocketOpened(bool is_tcp) {
+        if (is_tcp) {
+            Add(tcp_fallbacks_);
+        }
+        open_sockets_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void OnSocketClosed() {
+        open_sockets_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /* adds this channel's counters into stats, so shards can be summed */
+    void Collect(resolver_stats &stats) const {
+        for (size_t i = 0; i < resolver_stats::families; ++i) {
+            stats.queries_issued[i] += Load(queries_issued_[i]);
+            stats.queries_completed[i] += Load(queries_completed_[i]);
+        }
+        stats.queries_coalesced += Load(queries_coalesced_);
+        for (size_t i = 0; i < resolve_mode_count; ++i) {
+            stats.resolves_issued[i] += Load(resolves_issued_[i]);
+            stats.resolves_completed[i] += Load(resolves_completed_[i]);
+        }
+        for (size_t i = 0; i < resolver_stats::error_slots; ++i) {
+            stats.errors[i] += Load(errors_[i]);
+        }
+        stats.timeouts += Load(timeouts_);
+        stats.tcp_fallbacks += Load(tcp_fallbacks_);
+        stats.hedges += Load(hedges_);
+        stats.hedge_wins += Load(hedge_wins_);
+        stats.open_sockets += Gauge(open_sockets_);
+        stats.in_flight += Gauge(in_flight_);
+        for (size_t i = 0; i < resolver_stats::latency_buckets; ++i) {
+            stats.latency[i] += Load(latency_[i]);
+        }
+    }
+
+private:
+    using counter = std::atomic<uint64_t>;
+    using gauge = std::atomic<int64_t>;
+
+    static size_t FamilyIndex(int family) {
+        return family == AF_INET6 ? 1 : 0;
+    }
+
+    static void Add(counter &c) {
+        c.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static uint64_t Load(const counter &c) {
+        return c.load(std::memory_order_relaxed);
+    }
+
+    /* increments and decrements may be observed out of order */
+    static uint64_t Gauge(const gauge &g) {
+        auto value = g.load(std::memory_order_relaxed);
+        return value > 0 ? static_cast<uint64_t>(value) : 0;
+    }
+
+    counter queries_issued_[resolver_stats::families] = {};
+    counter queries_completed_[resolver_stats::families] = {};
+    counter queries_coalesced_{0};
+    counter resolves_issued_[resolve_mode_count] = {};
+    counter resolves_completed_[resolve_mode_count] = {};
+    counter errors_[resolver_stats::error_slots] = {};
+    counter timeouts_{0};
+    counter tcp_fallbacks_{0};
+    counter hedges_{0};
+    counter hedge_wins_{0};
+    gauge open_sockets_{0};
+    gauge in_flight_{0};
+    counter latency_[resolver_stats::latency_buckets] = {};
+};
+
+} // namespace detail
+} // namespace cares
+
+#endif // __CARES_SERVICES_STATS_HXX__
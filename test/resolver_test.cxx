@@ -0,0 +1,742 @@
+#define BOOST_TEST_MODULE cares_service
+#include <boost/test/included/unit_test.hpp>
+
+#include <numeric>
+#include <thread>
+#include <cares_service/cares.hxx>
+
+#include "stub_dns_server.hxx"
+
+namespace {
+
+using cares::test::StubDnsServer;
+
+struct Outcome {
+    boost::system::error_code ec;
+    std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+
+    size_t Count(bool v4) const {
+        return std::count_if(
+            endpoints.begin(), endpoints.end(),
+            [v4](const boost::asio::ip::tcp::endpoint &ep) { return ep.address().is_v4() == v4; }
+        );
+    }
+};
+
+template<class Resolver = cares::tcp::resolver>
+struct Fixture {
+    explicit Fixture(StubDnsServer::Options options = StubDnsServer::Options())
+        : server(options), resolver(context) {
+        boost::system::error_code ec;
+        resolver.set_servers(server.Servers(), ec);
+        BOOST_REQUIRE(!ec);
+    }
+
+    void SetMode(const std::string &mode) {
+        boost::system::error_code ec;
+        resolver.resolve_mode(mode, ec);
+        BOOST_REQUIRE(!ec);
+    }
+
+    void AsyncResolve(const std::string &name, Outcome &outcome, uint16_t port = 443) {
+        resolver.async_resolve(
+            name, port,
+            [&outcome](boost::system::error_code ec, typename Resolver::results_type results) {
+                outcome.ec = ec;
+                outcome.endpoints.assign(results.begin(), results.end());
+            }
+        );
+    }
+
+    Outcome Resolve(const std::string &name, uint16_t port = 443) {
+        Outcome outcome;
+        AsyncResolve(name, outcome, port);
+        Run();
+        return outcome;
+    }
+
+    void Run() {
+        context.restart();
+        context.run();
+    }
+
+    StubDnsServer server;
+    boost::asio::io_context context;
+    Resolver resolver;
+};
+
+std::string Addresses(const Outcome &outcome) {
+    std::string joined;
+    for (auto &ep : outcome.endpoints) {
+        joined += (joined.empty() ? "" : " ") + ep.address().to_string();
+    }
+    return joined;
+}
+
+/* a handler owning the memory its associated allocator hands out, as in asio's allocation example */
+struct HandlerArena {
+    alignas(std::max_align_t) unsigned char storage[2048];
+    bool in_use = false;
+    size_t allocations = 0;
+};
+
+template<class T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    explicit ArenaAllocator(HandlerArena *a)
+        : arena(a) {
+    }
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U> &other)
+        : arena(other.arena) {
+    }
+
+    T *allocate(size_t n) {
+        if (!arena->in_use && n * sizeof(T) <= sizeof arena->storage) {
+            arena->in_use = true;
+            ++arena->allocations;
+            return reinterpret_cast<T *>(arena->storage);
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t) {
+        if (reinterpret_cast<unsigned char *>(p) == arena->storage) {
+            arena->in_use = false;
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template<class U>
+    bool operator==(const ArenaAllocator<U> &other) const {
+        return arena == other.arena;
+    }
+
+    template<class U>
+    bool operator!=(const ArenaAllocator<U> &other) const {
+        return arena != other.arena;
+    }
+
+    HandlerArena *arena;
+};
+
+struct ArenaHandler {
+    using allocator_type = ArenaAllocator<void>;
+
+    allocator_type get_allocator() const {
+        return allocator_type{arena.get()};
+    }
+
+    void operator()(boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+        outcome->ec = ec;
+        outcome->endpoints.assign(results.begin(), results.end());
+        *used_arena = arena->allocations > 0;
+        *released = !arena->in_use;
+    }
+
+    std::shared_ptr<HandlerArena> arena;
+    Outcome *outcome;
+    bool *used_arena;
+    bool *released;
+};
+
+bool IsCaresError(const boost::system::error_code &ec, cares::error::basic_errors value) {
+    return ec.category() == cares::error::get_category() && ec.value() == value;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(resolves_every_mode) {
+    Fixture<> f;
+    struct Expect { const char *mode; size_t v4; size_t v6; int first; };
+    for (auto expect : {
+            Expect{"both", 2, 1, AF_UNSPEC},
+            Expect{"ipv4_first", 2, 1, AF_INET},
+            Expect{"ipv6_first", 2, 1, AF_INET6},
+            Expect{"ipv4_only", 2, 0, AF_INET},
+            Expect{"ipv6_only", 0, 1, AF_INET6}}) {
+        BOOST_TEST_CONTEXT(expect.mode) {
+            f.SetMode(expect.mode);
+            auto outcome = f.Resolve(std::string{"host-"} + expect.mode + ".test");
+            BOOST_TEST(!outcome.ec);
+            BOOST_TEST(outcome.Count(true) == expect.v4);
+            BOOST_TEST(outcome.Count(false) == expect.v6);
+            BOOST_REQUIRE(!outcome.endpoints.empty());
+            BOOST_TEST(outcome.endpoints.front().port() == 443);
+            if (expect.first != AF_UNSPEC) {
+                BOOST_TEST(outcome.endpoints.front().address().is_v4() == (expect.first == AF_INET));
+            }
+        }
+    }
+
+    f.SetMode("unspecific");
+    auto outcome = f.Resolve("host-unspecific.test");
+    BOOST_TEST(!outcome.ec);
+    BOOST_TEST(!outcome.endpoints.empty());
+}
+
+BOOST_AUTO_TEST_CASE(numeric_address_skips_query) {
+    Fixture<> f;
+    auto outcome = f.Resolve("192.0.2.77", 80);
+    BOOST_TEST(!outcome.ec);
+    BOOST_REQUIRE(outcome.endpoints.size() == 1u);
+    BOOST_TEST(outcome.endpoints.front().address().to_string() == "192.0.2.77");
+    BOOST_TEST(f.server.Queries() == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(negative_answers) {
+    Fixture<> f;
+    auto outcome = f.Resolve("nx.test");
+    BOOST_TEST(IsCaresError(outcome.ec, cares::error::not_found));
+    BOOST_TEST(outcome.endpoints.empty());
+
+    outcome = f.Resolve("v4.test");
+    BOOST_TEST(!outcome.ec);
+    BOOST_TEST(outcome.Count(true) == 2u);
+    BOOST_TEST(outcome.Count(false) == 0u);
+
+    f.SetMode("ipv6_only");
+    outcome = f.Resolve("nodata.test");
+    BOOST_TEST(outcome.ec);
+    BOOST_TEST(outcome.endpoints.empty());
+}
+
+BOOST_AUTO_TEST_CASE(truncated_answer_falls_back_to_tcp) {
+    Fixture<> f;
+    f.SetMode("ipv4_only");
+    auto outcome = f.Resolve("tc.test");
+    BOOST_TEST(!outcome.ec);
+    BOOST_TEST(outcome.Count(true) == 2u);
+    BOOST_TEST(f.server.TcpQueries() >= 1u);
+}
+
+BOOST_AUTO_TEST_CASE(handler_allocator_released_before_upcall) {
+    Fixture<> f;
+    std::string too_long(300, 'a');
+    for (auto name : {std::string{"arena.test"}, too_long}) {
+        for (auto mode : {"both", "ipv4_only"}) {
+            f.SetMode(mode);
+            Outcome outcome;
+            bool used_arena = false;
+            bool released = false;
+            /* the handler is the arena's only owner, it goes away with the handler */
+            f.resolver.async_resolve(
+                name, 443, ArenaHandler{std::make_shared<HandlerArena>(), &outcome, &used_arena, &released}
+            );
+            f.Run();
+            BOOST_TEST(used_arena);
+            BOOST_TEST(released);
+            BOOST_TEST(!outcome.ec == (name != too_long));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_queries_are_coalesced) {
+    Fixture<> f;
+    std::vector<Outcome> outcomes(20);
+    for (size_t i = 0; i < outcomes.size(); ++i) {
+        f.resolver.async_resolve(
+            "popular.test", 1000 + i,
+            [&outcomes, i](boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+                outcomes[i].ec = ec;
+                outcomes[i].endpoints.assign(results.begin(), results.end());
+            }
+        );
+    }
+    f.Run();
+    for (size_t i = 0; i < outcomes.size(); ++i) {
+        BOOST_TEST(!outcomes[i].ec);
+        BOOST_REQUIRE(outcomes[i].endpoints.size() == 3u);
+        BOOST_TEST(outcomes[i].endpoints.front().port() == 1000 + i);
+    }
+    BOOST_TEST(f.server.Queries() == 2u);
+}
+
+BOOST_AUTO_TEST_CASE(cache_honors_ttl) {
+    StubDnsServer::Options options;
+    options.ttl = 1;
+    Fixture<> f{options};
+    cares::cache_options cache;
+    cache.capacity = 16;
+    cache.negative_ttl = std::chrono::seconds{1};
+    f.resolver.set_cache_options(cache);
+
+    BOOST_TEST(!f.Resolve("cached.test").ec);
+    auto outcome = f.Resolve("cached.test", 80);
+    BOOST_TEST(!outcome.ec);
+    BOOST_TEST(outcome.endpoints.size() == 3u);
+    BOOST_TEST(outcome.endpoints.front().port() == 80);
+    BOOST_TEST(f.server.Queries() == 2u);
+
+    BOOST_TEST(IsCaresError(f.Resolve("nx.test").ec, cares::error::not_found));
+    BOOST_TEST(IsCaresError(f.Resolve("nx.test").ec, cares::error::not_found));
+    BOOST_TEST(f.server.Queries() == 4u);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{1100});
+    BOOST_TEST(!f.Resolve("cached.test").ec);
+    BOOST_TEST(f.server.Queries() == 6u);
+}
+
+BOOST_AUTO_TEST_CASE(cache_expires_partial_answer_early) {
+    Fixture<> f;
+    cares::cache_options cache;
+    cache.capacity = 16;
+    cache.negative_ttl = std::chrono::seconds{1};
+    f.resolver.set_cache_options(cache);
+
+    /* AAAA fails, the A-only answer must not live for the 300s record ttl */
+    auto outcome = f.Resolve("v6fail.test");
+    BOOST_TEST(!outcome.ec);
+    BOOST_TEST(outcome.Count(true) == 2u);
+    BOOST_TEST(outcome.Count(false) == 0u);
+    BOOST_TEST(f.Resolve("v6fail.test").endpoints.size() == 2u);
+    BOOST_TEST(f.server.Queries() == 2u);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{1100});
+    BOOST_TEST(f.Resolve("v6fail.test").endpoints.size() == 2u);
+    BOOST_TEST(f.server.Queries() == 4u);
+}
+
+BOOST_AUTO_TEST_CASE(cache_is_per_resolver) {
+    Fixture<> f;
+    f.SetMode("ipv4_only");
+    StubDnsServer other_server;
+    cares::tcp::resolver other{f.context};
+    boost::system::error_code ec;
+    other.set_servers(other_server.Servers(), ec);
+    BOOST_REQUIRE(!ec);
+    other.resolve_mode("ipv4_only", ec);
+    BOOST_REQUIRE(!ec);
+    auto resolve_other = [&]() {
+        Outcome outcome;
+        other.async_resolve(
+            "split.test", 443,
+            [&outcome](boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+                outcome.ec = ec;
+                outcome.endpoints.assign(results.begin(), results.end());
+            }
+        );
+        f.Run();
+        return outcome;
+    };
+
+    cares::cache_options cache;
+    cache.capacity = 16;
+    f.resolver.set_cache_options(cache);
+    BOOST_TEST(!f.Resolve("split.test").ec);
+    BOOST_TEST(!f.Resolve("split.test").ec);
+    BOOST_TEST(f.server.Queries() == 1u);
+
+    /* enabling the cache on one resolver leaves the other one alone */
+    BOOST_TEST(!resolve_other().ec);
+    BOOST_TEST(!resolve_other().ec);
+    BOOST_TEST(other_server.Queries() == 2u);
+
+    /* and its answers never come from the first resolver's servers */
+    other.set_cache_options(cache);
+    BOOST_TEST(!resolve_other().ec);
+    BOOST_TEST(!resolve_other().ec);
+    BOOST_TEST(other_server.Queries() == 3u);
+    BOOST_TEST(f.server.Queries() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(batch_reports_statistics) {
+    StubDnsServer::Options options;
+    options.latency = std::chrono::milliseconds{20};
+    Fixture<> f{options};
+    f.SetMode("ipv4_only");
+    std::vector<std::pair<std::string, uint16_t>> queries;
+    for (int i = 0; i < 40; ++i) {
+        queries.emplace_back((i % 4 ? "" : "nx.") + std::string{"batch"} + std::to_string(i) + ".test", 53);
+    }
+    size_t results = 0;
+    cares::batch_statistics stats;
+    f.resolver.async_resolve_batch(
+        queries, 4,
+        [&results](boost::system::error_code, const std::string &, cares::tcp::resolver::results_type) {
+            ++results;
+        },
+        [&stats](const cares::batch_statistics &s) {
+            stats = s;
+        }
+    );
+    f.Run();
+    BOOST_TEST(results == queries.size());
+    BOOST_TEST(stats.total == queries.size());
+    BOOST_TEST(stats.succeeded == 30u);
+    BOOST_TEST(stats.failed == 10u);
+    BOOST_TEST(stats.elapsed.count() > 0);
+
+    /* one query per resolve in ipv4_only mode, so never more than the window at the server */
+    BOOST_TEST(f.server.Queries() == queries.size());
+    BOOST_TEST(f.server.PeakPending() <= 4u);
+    BOOST_TEST(f.server.PeakPending() >= 2u);
+    BOOST_CHECK(stats.elapsed >= std::chrono::milliseconds{200});
+}
+
+BOOST_AUTO_TEST_CASE(pool_resolver_on_many_threads) {
+    Fixture<cares::tcp::pool_resolver> f;
+    boost::system::error_code ec;
+    f.resolver.shards(4, ec);
+    BOOST_REQUIRE(!ec);
+    f.resolver.set_servers(f.server.Servers(), ec);
+    BOOST_REQUIRE(!ec);
+    BOOST_TEST(f.resolver.shards() == 4u);
+    cares::cache_options cache;
+    cache.capacity = 64;
+    f.resolver.set_cache_options(cache);
+
+    /* the second round is answered by the per-shard caches */
+    for (int round = 0; round < 2; ++round) {
+        std::vector<Outcome> outcomes(64);
+        for (size_t i = 0; i < outcomes.size(); ++i) {
+            f.AsyncResolve("pool" + std::to_string(i % 16) + ".test", outcomes[i]);
+        }
+        f.context.restart();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&f]() { f.context.run(); });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+        for (auto &outcome : outcomes) {
+            BOOST_TEST(!outcome.ec);
+            BOOST_TEST(outcome.endpoints.size() == 3u);
+        }
+        BOOST_TEST(f.server.Queries() == 32u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(pool_reshards_while_resolving) {
+    Fixture<cares::tcp::pool_resolver> f;
+    boost::system::error_code ec;
+    f.resolver.shards(2, ec);
+    BOOST_REQUIRE(!ec);
+    f.resolver.set_servers(f.server.Servers(), ec);
+    BOOST_REQUIRE(!ec);
+
+    auto work = boost::asio::make_work_guard(f.context);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&f]() { f.context.run(); });
+    }
+
+    std::vector<Outcome> outcomes(200);
+    std::atomic<size_t> done{0};
+    std::thread producer([&]() {
+        for (size_t i = 0; i < outcomes.size(); ++i) {
+            f.resolver.async_resolve(
+                "reshard" + std::to_string(i) + ".test", 443,
+                [&outcomes, &done, i](boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+                    outcomes[i].ec = ec;
+                    outcomes[i].endpoints.assign(results.begin(), results.end());
+                    ++done;
+                }
+            );
+        }
+    });
+    /* resizing and scraping race with the producer above */
+    for (size_t shards = 3; shards < 8; ++shards) {
+        f.resolver.shards(shards, ec);
+        BOOST_TEST(!ec);
+        f.resolver.stats();
+    }
+    producer.join();
+    while (done < outcomes.size()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{5});
+    }
+    work.reset();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    BOOST_TEST(f.resolver.shards() == 7u);
+    for (auto &outcome : outcomes) {
+        BOOST_TEST(!outcome.ec);
+        BOOST_TEST(outcome.endpoints.size() == 3u);
+    }
+    auto stats = f.resolver.stats();
+    BOOST_TEST(stats.resolves_completed[cares::detail::both] == outcomes.size());
+}
+
+BOOST_AUTO_TEST_CASE(happy_eyeballs_delivers_before_slow_aaaa) {
+    StubDnsServer::Options options;
+    options.aaaa_latency = std::chrono::milliseconds{400};
+    Fixture<> f{options};
+    f.SetMode("happy_eyeballs");
+    f.resolver.resolution_delay(std::chrono::milliseconds{50});
+    cares::cache_options cache;
+    cache.capacity = 16;
+    f.resolver.set_cache_options(cache);
+
+    Outcome first, more;
+    bool more_called = false;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration first_latency{0};
+    f.resolver.async_resolve(
+        "eyeballs.test", 443,
+        [&](boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+            first_latency = std::chrono::steady_clock::now() - start;
+            first.ec = ec;
+            first.endpoints.assign(results.begin(), results.end());
+        },
+        [&](boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+            BOOST_TEST(!first.endpoints.empty());
+            more_called = true;
+            more.ec = ec;
+            more.endpoints.assign(results.begin(), results.end());
+        }
+    );
+    f.Run();
+    BOOST_TEST(!first.ec);
+    BOOST_TEST(first.Count(true) == 2u);
+    BOOST_TEST(first.Count(false) == 0u);
+    BOOST_CHECK(first_latency < std::chrono::milliseconds{300});
+    BOOST_REQUIRE(more_called);
+    BOOST_TEST(!more.ec);
+    BOOST_TEST(more.Count(false) == 1u);
+    BOOST_TEST(more.endpoints.front().port() == 443);
+
+    /* the late AAAA records were merged into the cached answer, in fresh order */
+    auto outcome = f.Resolve("eyeballs.test");
+    BOOST_TEST(Addresses(outcome) == "2001:db8::1 192.0.2.1 192.0.2.2");
+    BOOST_TEST(f.server.Queries() == 2u);
+
+    Fixture<> fresh;
+    fresh.SetMode("happy_eyeballs");
+    BOOST_TEST(Addresses(fresh.Resolve("eyeballs.test")) == "2001:db8::1 192.0.2.1 192.0.2.2");
+
+    /* a late failure still reaches the second handler, nothing follows it */
+    f.resolver.async_resolve(
+        "v4.test", 443,
+        [&first](boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+            first.ec = ec;
+            first.endpoints.assign(results.begin(), results.end());
+        },
+        [&more](boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+            more.ec = ec;
+            more.endpoints.assign(results.begin(), results.end());
+        }
+    );
+    f.Run();
+    BOOST_TEST(!first.ec);
+    BOOST_TEST(first.Count(true) == 2u);
+    BOOST_TEST(IsCaresError(more.ec, cares::error::no_data));
+    BOOST_TEST(more.endpoints.empty());
+}
+
+BOOST_AUTO_TEST_CASE(stats_count_queries_and_errors) {
+    Fixture<> f;
+    std::vector<Outcome> outcomes(4);
+    for (auto &outcome : outcomes) {
+        f.AsyncResolve("counted.test", outcome);
+    }
+    f.Run();
+    f.SetMode("ipv4_only");
+    BOOST_TEST(IsCaresError(f.Resolve("nx.test").ec, cares::error::not_found));
+    BOOST_TEST(!f.Resolve("tc.test").ec);
+
+    auto stats = f.resolver.stats();
+    BOOST_TEST(stats.queries_issued[0] == 3u);
+    BOOST_TEST(stats.queries_issued[1] == 1u);
+    BOOST_TEST(stats.queries_completed[0] == 3u);
+    BOOST_TEST(stats.queries_completed[1] == 1u);
+    BOOST_TEST(stats.queries_coalesced == 6u);
+    BOOST_TEST(stats.resolves_issued[cares::detail::both] == 4u);
+    BOOST_TEST(stats.resolves_completed[cares::detail::both] == 4u);
+    BOOST_TEST(stats.resolves_completed[cares::detail::ipv4_only] == 2u);
+    BOOST_TEST(stats.errors[cares::error::not_found] == 1u);
+    BOOST_TEST(stats.tcp_fallbacks >= 1u);
+    BOOST_TEST(stats.in_flight == 0u);
+    BOOST_TEST(std::accumulate(std::begin(stats.latency), std::end(stats.latency), uint64_t{0}) == 6u);
+    BOOST_TEST(stats.latency_quantile(0.5).count() > 0);
+
+    uint64_t exported = 0;
+    stats.visit([&exported](const std::string &name, uint64_t value) {
+        if (name == "errors.not_found" || name == "queries_issued.ipv6") {
+            exported += value;
+        }
+    });
+    BOOST_TEST(exported == 2u);
+}
+
+BOOST_AUTO_TEST_CASE(hedged_query_prefers_fast_server) {
+    StubDnsServer::Options slow_options;
+    slow_options.latency = std::chrono::milliseconds{300};
+    Fixture<> f{slow_options};
+    StubDnsServer fast;
+    f.SetMode("ipv4_only");
+
+    cares::hedge_options hedge;
+    hedge.delay = std::chrono::milliseconds{50};
+    boost::system::error_code ec;
+    f.resolver.set_hedge_options(hedge, ec);
+    BOOST_REQUIRE(!ec);
+    f.resolver.set_servers(f.server.Servers() + "," + fast.Servers(), ec);
+    BOOST_REQUIRE(!ec);
+
+    /* both servers are unknown, the slow one is asked first and loses */
+    Outcome outcome;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration latency{0};
+    f.resolver.async_resolve(
+        "hedge1.test", 443,
+        [&](boost::system::error_code ec, cares::tcp::resolver::results_type results) {
+            latency = std::chrono::steady_clock::now() - start;
+            outcome.ec = ec;
+            outcome.endpoints.assign(results.begin(), results.end());
+        }
+    );
+    f.Run();
+    BOOST_TEST(!outcome.ec);
+    BOOST_TEST(outcome.Count(true) == 2u);
+    BOOST_CHECK(latency < std::chrono::milliseconds{250});
+    BOOST_TEST(f.server.Queries() == 1u);
+    BOOST_TEST(fast.Queries() == 1u);
+
+    /* its late answer demoted it behind the fast server */
+    BOOST_TEST(!f.Resolve("hedge2.test").ec);
+    BOOST_TEST(f.server.Queries() == 1u);
+    BOOST_TEST(fast.Queries() == 2u);
+
+    auto stats = f.resolver.stats();
+    BOOST_TEST(stats.hedges == 1u);
+    BOOST_TEST(stats.hedge_wins == 1u);
+    BOOST_TEST(stats.in_flight == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(hedging_uses_servers_of_the_handle) {
+    StubDnsServer::Options slow_options;
+    slow_options.latency = std::chrono::milliseconds{300};
+    Fixture<> f{slow_options};
+    StubDnsServer fast;
+    f.SetMode("ipv4_only");
+    f.Run();
+
+    /* servers set behind set_servers' back, as resolv.conf ones would be */
+    auto servers = f.server.Servers() + "," + fast.Servers();
+    BOOST_REQUIRE(::ares_set_servers_ports_csv(f.resolver.native_handle(), servers.c_str()) == ARES_SUCCESS);
+    cares::hedge_options hedge;
+    hedge.delay = std::chrono::milliseconds{50};
+    boost::system::error_code ec;
+    f.resolver.set_hedge_options(hedge, ec);
+    BOOST_REQUIRE(!ec);
+
+    /* Run() also waits for the losing attempt, so time the handler */
+    Outcome outcome;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration latency{0};
+    f.resolver.async_resolve(
+        "handle.test", 443,
+        [&](boost::system::error_code ec, cares::tcp::resolver::results_type) {
+            latency = std::chrono::steady_clock::now() - start;
+            outcome.ec = ec;
+        }
+    );
+    f.Run();
+    BOOST_TEST(!outcome.ec);
+    BOOST_CHECK(latency < std::chrono::milliseconds{250});
+    BOOST_TEST(fast.Queries() == 1u);
+    BOOST_TEST(f.resolver.stats().hedge_wins == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(failover_is_not_a_hedge_win) {
+    Fixture<> f;
+    f.SetMode("ipv4_only");
+    uint16_t closed_port;
+    {
+        boost::asio::ip::udp::socket probe{f.context, boost::asio::ip::udp::endpoint{boost::asio::ip::make_address("127.0.0.1"), 0}};
+        closed_port = probe.local_endpoint().port();
+    }
+
+    cares::hedge_options hedge;
+    hedge.delay = std::chrono::seconds{1};
+    boost::system::error_code ec;
+    f.resolver.set_hedge_options(hedge, ec);
+    BOOST_REQUIRE(!ec);
+    f.resolver.set_servers("127.0.0.1:" + std::to_string(closed_port) + "," + f.server.Servers(), ec);
+    BOOST_REQUIRE(!ec);
+
+    /* the refused first server moves the query on at once, without a race to win */
+    auto start = std::chrono::steady_clock::now();
+    BOOST_TEST(!f.Resolve("failover.test").ec);
+    BOOST_CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds{500});
+    auto stats = f.resolver.stats();
+    BOOST_TEST(stats.hedges == 1u);
+    BOOST_TEST(stats.hedge_wins == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(set_servers_with_query_in_flight) {
+    StubDnsServer::Options slow_options;
+    slow_options.latency = std::chrono::milliseconds{200};
+    Fixture<> f{slow_options};
+    StubDnsServer fast;
+    f.SetMode("ipv4_only");
+
+    Outcome outcome;
+    f.AsyncResolve("inflight.test", outcome);
+    f.context.restart();
+    f.context.run_for(std::chrono::milliseconds{50});
+    BOOST_REQUIRE(f.server.Queries() == 1u);
+
+    /* the pending query keeps its old handle, new ones go to the new server */
+    boost::system::error_code ec;
+    f.resolver.set_servers(fast.Servers(), ec);
+    BOOST_REQUIRE(!ec);
+    f.Run();
+    BOOST_TEST(!outcome.ec);
+    BOOST_TEST(outcome.Count(true) == 2u);
+
+    BOOST_TEST(!f.Resolve("after.test").ec);
+    BOOST_TEST(f.server.Queries() == 1u);
+    BOOST_TEST(fast.Queries() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(set_servers_keeps_hedged_query_in_flight) {
+    StubDnsServer::Options slow_options;
+    slow_options.latency = std::chrono::milliseconds{300};
+    Fixture<> f{slow_options};
+    StubDnsServer other{slow_options};
+    StubDnsServer fast;
+    f.SetMode("ipv4_only");
+
+    cares::hedge_options hedge;
+    hedge.delay = std::chrono::seconds{1};
+    boost::system::error_code ec;
+    f.resolver.set_hedge_options(hedge, ec);
+    BOOST_REQUIRE(!ec);
+    f.resolver.set_servers(f.server.Servers() + "," + other.Servers(), ec);
+    BOOST_REQUIRE(!ec);
+
+    Outcome outcome;
+    f.AsyncResolve("inflight.test", outcome);
+    f.context.restart();
+    f.context.run_for(std::chrono::milliseconds{50});
+    BOOST_REQUIRE(f.server.Queries() == 1u);
+
+    /* the first server is dropped while its attempt is still pending */
+    f.resolver.set_servers(other.Servers() + "," + fast.Servers(), ec);
+    BOOST_REQUIRE(!ec);
+    f.Run();
+    BOOST_TEST(!outcome.ec);
+    BOOST_TEST(outcome.Count(true) == 2u);
+
+    BOOST_TEST(!f.Resolve("after.test").ec);
+    BOOST_TEST(f.server.Queries() == 1u);
+    BOOST_TEST(other.Queries() + fast.Queries() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(unanswered_query_times_out) {
+    Fixture<> f;
+    f.SetMode("ipv4_only");
+    auto start = std::chrono::steady_clock::now();
+    auto outcome = f.Resolve("drop.test");
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    BOOST_TEST(IsCaresError(outcome.ec, cares::error::timeout));
+    BOOST_CHECK(elapsed >= std::chrono::milliseconds{2900});
+    BOOST_CHECK(elapsed < std::chrono::milliseconds{3500});
+}
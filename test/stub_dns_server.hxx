@@ -0,0 +1,297 @@
+#ifndef __CARES_SERVICES_TEST_STUB_DNS_SERVER_HXX__
+#define __CARES_SERVICES_TEST_STUB_DNS_SERVER_HXX__
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+namespace cares {
+namespace test {
+
+/*
+ * In-process DNS responder on 127.0.0.1, serving UDP and TCP on one port.
+ * The first label of the query name selects the answer:
+ *   nx.*      NXDOMAIN
+ *   nodata.*  NOERROR without records
+ *   tc.*      truncated over UDP, full answer over TCP
+ *   drop.*    never answered
+ *   v4.*      A records only, AAAA gets NODATA
+ *   v6fail.*  A records, AAAA gets SERVFAIL
+ *   anything else gets two A records and one AAAA record.
+ */
+class StubDnsServer {
+public:
+    struct Options {
+        /* delay before every answer */
+        std::chrono::milliseconds latency{0};
+        /* extra delay applied to AAAA answers only */
+        std::chrono::milliseconds aaaa_latency{0};
+        /* probability of silently dropping a UDP query */
+        double loss = 0.0;
+        uint32_t ttl = 300;
+    };
+
+    static constexpr uint16_t kTypeA = 1;
+    static constexpr uint16_t kTypeAAAA = 28;
+
+    StubDnsServer()
+        : StubDnsServer(Options{}) {
+    }
+
+    explicit StubDnsServer(Options options)
+        : options_(options), udp_(context_), acceptor_(context_), random_(42),
+          udp_queries_(0), tcp_queries_(0), pending_(0), peak_pending_(0) {
+        using boost::asio::ip::tcp;
+        using boost::asio::ip::udp;
+        auto loopback = boost::asio::ip::make_address_v4("127.0.0.1");
+        udp_.open(udp::v4());
+        udp_.bind(udp::endpoint{loopback, 0});
+        /* bursts of hundreds of queries must not be dropped by the kernel */
+        udp_.set_option(boost::asio::socket_base::receive_buffer_size(4 << 20));
+        port_ = udp_.local_endpoint().port();
+
+        acceptor_.open(tcp::v4());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.bind(tcp::endpoint{loopback, port_});
+        acceptor_.listen();
+
+        ReceiveUdp();
+        Accept();
+        thread_ = std::thread([this]() { context_.run(); });
+    }
+
+    ~StubDnsServer() {
+        context_.stop();
+        thread_.join();
+    }
+
+    uint16_t Port() const {
+        return port_;
+    }
+
+    std::string Servers() const {
+        return "127.0.0.1:" + std::to_string(port_);
+    }
+
+    size_t UdpQueries() const {
+        return udp_queries_;
+    }
+
+    size_t TcpQueries() const {
+        return tcp_queries_;
+    }
+
+    size_t Queries() const {
+        return UdpQueries() + TcpQueries();
+    }
+
+    /* most answers held back by latency at the same time */
+    size_t PeakPending() const {
+        return peak_pending_;
+    }
+
+    static boost::asio::ip::address_v4 AddressV4(int index) {
+        return boost::asio::ip::make_address_v4(index == 0 ? "192.0.2.1" : "192.0.2.2");
+    }
+
+    static boost::asio::ip::address_v6 AddressV6() {
+        return boost::asio::ip::make_address_v6("2001:db8::1");
+    }
+
+private:
+    using buffer_type = std::vector<uint8_t>;
+
+    struct TcpSession : public std::enable_shared_from_this<TcpSession> {
+        explicit TcpSession(boost::asio::ip::tcp::socket s)
+            : socket(std::move(s)) {
+        }
+
+        boost::asio::ip::tcp::socket socket;
+        uint8_t length[2];
+        buffer_type query;
+    };
+
+    void ReceiveUdp() {
+        udp_.async_receive_from(
+            boost::asio::buffer(udp_buffer_), udp_peer_,
+            [this](boost::system::error_code ec, size_t size) {
+                if (ec) {
+                    return;
+                }
+                ++udp_queries_;
+                buffer_type query(udp_buffer_, udp_buffer_ + size);
+                auto peer = udp_peer_;
+                ReceiveUdp();
+                if (std::uniform_real_distribution<double>{0, 1}(random_) < options_.loss) {
+                    return;
+                }
+                buffer_type answer;
+                std::chrono::milliseconds delay;
+                if (!BuildAnswer(query, false, answer, delay)) {
+                    return;
+                }
+                Delay(delay, [this, peer, answer{std::move(answer)}]() {
+                    boost::system::error_code ignored;
+                    udp_.send_to(boost::asio::buffer(answer), peer, 0, ignored);
+                });
+            }
+        );
+    }
+
+    void Accept() {
+        acceptor_.async_accept(
+            [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+                if (ec) {
+                    return;
+                }
+                ReadTcp(std::make_shared<TcpSession>(std::move(socket)));
+                Accept();
+            }
+        );
+    }
+
+    void ReadTcp(std::shared_ptr<TcpSession> session) {
+        boost::asio::async_read(
+            session->socket, boost::asio::buffer(session->length),
+            [this, session](boost::system::error_code ec, size_t) {
+                if (ec) {
+                    return;
+                }
+                session->query.resize((session->length[0] << 8) | session->length[1]);
+                boost::asio::async_read(
+                    session->socket, boost::asio::buffer(session->query),
+                    [this, session](boost::system::error_code ec, size_t) {
+                        if (ec) {
+                            return;
+                        }
+                        ++tcp_queries_;
+                        buffer_type answer;
+                        std::chrono::milliseconds delay;
+                        if (BuildAnswer(session->query, true, answer, delay)) {
+                            uint8_t prefix[2] = {uint8_t(answer.size() >> 8), uint8_t(answer.size())};
+                            answer.insert(answer.begin(), prefix, prefix + 2);
+                            Delay(delay, [session, answer{std::move(answer)}]() {
+                                boost::system::error_code ignored;
+                                boost::asio::write(session->socket, boost::asio::buffer(answer), ignored);
+                            });
+                        }
+                        ReadTcp(session);
+                    }
+                );
+            }
+        );
+    }
+
+    template<class Callback>
+    void Delay(std::chrono::milliseconds delay, Callback &&cb) {
+        if (delay.count() == 0) {
+            cb();
+            return;
+        }
+        if (++pending_ > peak_pending_) {
+            peak_pending_ = pending_;
+        }
+        auto timer = std::make_shared<boost::asio::steady_timer>(context_, delay);
+        timer->async_wait([this, timer, cb{std::move(cb)}](boost::system::error_code) {
+            --pending_;
+            cb();
+        });
+    }
+
+    bool BuildAnswer(const buffer_type &query, bool is_tcp, buffer_type &answer, std::chrono::milliseconds &delay) {
+        if (query.size() < 12) {
+            return false;
+        }
+        size_t pos = 12;
+        std::string first_label;
+        while (pos < query.size() && query[pos] != 0) {
+            size_t len = query[pos];
+            if (first_label.empty() && pos == 12) {
+                first_label.assign(query.begin() + pos + 1, query.begin() + std::min(query.size(), pos + 1 + len));
+            }
+            pos += 1 + len;
+        }
+        pos += 1;
+        if (pos + 4 > query.size()) {
+            return false;
+        }
+        uint16_t qtype = (query[pos] << 8) | query[pos + 1];
+        pos += 4;
+
+        if (first_label == "drop") {
+            return false;
+        }
+
+        delay = options_.latency + (qtype == kTypeAAAA ? options_.aaaa_latency : std::chrono::milliseconds{0});
+
+        uint16_t flags = 0x8180;
+        std::vector<buffer_type> records;
+        if (first_label == "nx") {
+            flags |= 3;
+        } else if (first_label == "v6fail" && qtype == kTypeAAAA) {
+            flags |= 2;
+        } else if (first_label == "tc" && !is_tcp) {
+            flags |= 0x0200;
+        } else if (first_label == "nodata" || (first_label == "v4" && qtype == kTypeAAAA)) {
+        } else if (qtype == kTypeA) {
+            for (int i = 0; i < 2; ++i) {
+                auto bytes = AddressV4(i).to_bytes();
+                records.emplace_back(bytes.begin(), bytes.end());
+            }
+        } else if (qtype == kTypeAAAA) {
+            auto bytes = AddressV6().to_bytes();
+            records.emplace_back(bytes.begin(), bytes.end());
+        }
+
+        answer.assign(query.begin(), query.begin() + pos);
+        Put16(answer, 2, flags);
+        Put16(answer, 6, records.size());
+        Put16(answer, 8, 0);
+        Put16(answer, 10, 0);
+        for (auto &rdata : records) {
+            uint8_t rr[12] = {0xc0, 0x0c};
+            rr[2] = qtype >> 8;
+            rr[3] = qtype & 0xff;
+            rr[5] = 1;
+            rr[6] = options_.ttl >> 24;
+            rr[7] = options_.ttl >> 16;
+            rr[8] = options_.ttl >> 8;
+            rr[9] = options_.ttl;
+            rr[11] = rdata.size();
+            answer.insert(answer.end(), rr, rr + sizeof rr);
+            answer.insert(answer.end(), rdata.begin(), rdata.end());
+        }
+        return true;
+    }
+
+    static void Put16(buffer_type &buf, size_t pos, uint16_t value) {
+        buf[pos] = value >> 8;
+        buf[pos + 1] = value & 0xff;
+    }
+
+    Options options_;
+    boost::asio::io_context context_;
+    boost::asio::ip::udp::socket udp_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    boost::asio::ip::udp::endpoint udp_peer_;
+    uint8_t udp_buffer_[512];
+    std::mt19937 random_;
+    uint16_t port_;
+    std::atomic<size_t> udp_queries_;
+    std::atomic<size_t> tcp_queries_;
+    /* only touched on the server thread */
+    size_t pending_;
+    std::atomic<size_t> peak_pending_;
+    std::thread thread_;
+};
+
+} // namespace test
+} // namespace cares
+
+#endif // __CARES_SERVICES_TEST_STUB_DNS_SERVER_HXX__